@@ -5,14 +5,26 @@
 #define _GNU_SOURCE
 
 #include <ctype.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/ioctl.h> //ioctl(), TIOCGWINSZ, struct winsize
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h> //writev()
+#include <sys/wait.h>
 #include <termios.h>
 #include <time.h>
 #include <unistd.h>
@@ -22,7 +34,58 @@
 #define KILO_VERSION "0.0.1"
 #define KILO_TAB_STOP 8
 #define KILO_QUIT_TIMES 3
-#define STACK_INIT_SIZE 20
+//切分文件时每次处理的块大小、并行切分时每个线程至少处理的字节数、最多线程数
+#define KILO_LOAD_BLOCK (64 * 1024)
+#define KILO_LOAD_CHUNK (4 * 1024 * 1024)
+#define KILO_LOAD_MAX_THREADS 16
+//多线程查找时每块包含的叶子数（每片叶子最多ROW_FANOUT行）
+#define KILO_SEARCH_BLOCK 64
+//正则查找时每个DFA缓存的状态数上限（满了就清空重建）、状态哈希表大小、字面前缀的最大长度
+#define KILO_REGEX_STATES 1024
+#define KILO_REGEX_HASH 4096
+#define KILO_REGEX_PREFIX 64
+//可能的最后一个字节不超过这么多种时，反向扫描跳过其余的字节
+#define KILO_REGEX_SKIP 64
+//渲染缓存的默认项数
+#define KILO_RENDER_CACHE 256
+//行文本和渲染的分配器：最小、最大的大小类，每次向系统申请的块大小
+#define KILO_SLAB_MIN 16
+#define KILO_SLAB_MAX 4096
+#define KILO_SLAB_CLASSES 9
+#define KILO_SLAB_BLOCK (64 * 1024)
+#define KILO_SLAB_DIR 1024 //块目录每一页记录的块数，也是目录的页数
+//撤销记录占用内存的默认上限，超出后丢弃最早的撤销组。运行时可用MINIVIM_UNDOMEM（MB）设置
+#ifndef KILO_UNDO_MEM_LIMIT
+#define KILO_UNDO_MEM_LIMIT (64 * 1024 * 1024)
+#endif
+//保存方式：SAVE_DELTA只改写修改过的部分，SAVE_ATOMIC总是完整写临时文件再改名
+enum saveMode
+{
+    SAVE_ATOMIC = 0,
+    SAVE_DELTA, //从第一处修改重写到文件末尾
+    SAVE_PATCH  //总长不变，只覆盖修改过的范围
+};
+//崩溃恢复日志：空闲这么多毫秒后写盘，积累这么多字节时立即写盘，超过这么长时尝试压缩
+#define KILO_JOURNAL_IDLE 500
+#define KILO_JOURNAL_BATCH (1024 * 1024)
+#define KILO_JOURNAL_COMPACT (16 * 1024 * 1024)
+#define KILO_JOURNAL_MAGIC "MVJOURN1"
+//保存时修改过的行复制到这么大的块中；每次writev最多写KILO_SAVE_BLOCK字节，以便报告进度
+#define KILO_SAVE_CHUNK (1024 * 1024)
+#define KILO_SAVE_BLOCK (8 * 1024 * 1024)
+#define KILO_SAVE_IOV 1024
+//需要改写的部分超过文件的1/KILO_SAVE_DELTA_DIV时不再就地改写，完整写临时文件再改名
+#define KILO_SAVE_DELTA_DIV 4
+
+//输入环形缓冲的大小（2的幂），单独的ESC之后等待转义序列其余部分的默认毫秒数，
+//终端应答（如光标位置）最多等待的毫秒数
+#define KILO_INPUT_BUF (64 * 1024)
+#define KILO_ESC_TIMEOUT 25
+#define KILO_REPLY_TIMEOUT 100
+//粘贴内容在这么多毫秒内没有新的字节且没有结束标记时，当作粘贴已结束
+#define KILO_PASTE_TIMEOUT 1000
+//两帧之间至少间隔的毫秒数（约60帧每秒），输入连续到达时先处理完再刷新
+#define KILO_FRAME_MS 16
 
 //定义ctrl组合输入的宏函数
 #define CTRL_KEY(k) ((k)&0x1f)
@@ -39,21 +102,449 @@ enum editorKey
     HOME_KEY,
     END_KEY,
     PAGE_UP,
-    PAGE_DOWN
+    PAGE_DOWN,
+    PASTE_KEY //括号粘贴模式下的一整段粘贴，内容在E.input.paste中
 };
 
-#define RECORD_TIMES 20
 /*** data ***/
-//行信息
+//撤销记录的类型
+enum undoType
+{
+    UNDO_INSERT,
+    UNDO_DELETE,
+    UNDO_REPLACE //行内的一段换成新文本
+};
+//编译后的查找模式，在多行中查找时只预处理一次
+typedef struct searchPattern
+{
+    char *p;
+    int len;
+    int shift[256];   //Horspool坏字符跳转表
+    int regex;        //是否按正则表达式查找
+    struct regex *re; //正则表达式的编译结果
+    const char *err;  //正则表达式有错误时的说明，这时没有匹配
+} searchPattern;
+//一个匹配位置
+typedef struct searchMatch
+{
+    int row;
+    int col;
+    int len;
+} searchMatch;
+//正则表达式NFA节点的类型
+enum regexOp
+{
+    RX_CHAR,  //读入cls中的一个字节
+    RX_SPLIT, //空转移到out和out1
+    RX_JMP,   //空转移到out
+    RX_BOL,   //只在行首通过
+    RX_EOL,   //只在行尾通过
+    RX_MATCH
+};
+typedef struct regexNode
+{
+    int op;
+    int out, out1;
+    unsigned char cls[32]; //RX_CHAR可读入的字节集合
+} regexNode;
+//Thompson构造的NFA，ustart在start前面加了一个跳过任意字节的循环
+typedef struct regexNfa
+{
+    regexNode *node;
+    int n, cap;
+    int start, ustart;
+} regexNfa;
+//构造中的NFA片段，end是出口处待连接的空转移
+typedef struct regexFrag
+{
+    int start, end;
+} regexFrag;
+typedef struct regexParser
+{
+    const char *p, *end;
+    regexNfa *nfa;
+    int rev; //构造匹配反转文本的NFA
+    const char *err;
+} regexParser;
+/*编译后的正则表达式：正向的NFA从起点求最长匹配，反向的NFA从行尾向前找出匹配的起点。
+编译后只读，各线程共用*/
+typedef struct regex
+{
+    int id; //编号，DFA缓存据此判断是否属于这个表达式
+    regexNfa fwd, rev;
+    int bol;              //只能在行首匹配
+    int literal;          //整个表达式就是prefix这个字面串
+    int last;             //每个匹配的最后一个字节都相同时为这个字节，否则为-1
+    int skip;             //可能的最后一个字节不多，反向扫描时可以跳过其余的字节
+    unsigned char end[256]; //各字节是否可能是匹配的最后一个字节
+    searchPattern prefix; //每个匹配共同的字面前缀，len为0时没有
+} regex;
+//惰性构造的DFA状态对应的NFA节点集合
+typedef struct dfaState
+{
+    int *set; //有序的NFA节点，只含RX_CHAR、RX_MATCH和未通过的RX_EOL
+    int nset;
+    int hnext;
+} dfaState;
+//DFA状态的标志
+enum dfaFlag
+{
+    DFA_ACCEPT = 1,    //读到这里是一个匹配
+    DFA_ACCEPTEND = 2, //这里是行尾时是一个匹配
+    DFA_DEAD = 4       //不会再有匹配
+};
+/*状态s读入字节c后的状态为trans[s * 256 + c]，值预先乘了256，-1表示还没有计算。
+查找时每个字节只查一次表*/
+typedef struct regexDfa
+{
+    const regexNfa *nfa;
+    int root;
+    dfaState *st;
+    int *trans;
+    unsigned char *flag;
+    int n, cap;
+    int resets; //清空的次数
+    int hash[KILO_REGEX_HASH];
+    int start[2]; //不在/在行首的起始状态，-1表示还没有构造
+    int *stack, *set, *tmp; //求闭包用的临时数组
+    unsigned *mark, gen;
+} regexDfa;
+//DFA缓存，每个线程各用一个，属于编号为id的表达式
+typedef struct regexCache
+{
+    int id;
+    regexDfa fwd, rev;
+    int *starts; //反向扫描找到的匹配起点
+    int nstarts, startcap;
+} regexCache;
+//查找分块的结果，每块由一个工作线程扫描
+typedef struct searchBlock
+{
+    int done;
+    searchMatch *m; //块内按位置排序的全部匹配
+    int n;
+} searchBlock;
+//一条撤销记录：在(row,col)处插入或删除的文本，以及编辑前的光标
+typedef struct undoRecord
+{
+    int type;
+    int group; //同组的记录一起撤销、重做
+    int row, col;
+    char *text; //替换记录中是len字节的旧文本，紧接着rlen字节的新文本
+    int len, cap;
+    int rlen;
+    int cx, cy;
+} undoRecord;
+//撤销日志
+struct undoLog
+{
+    undoRecord *rec;
+    int len, cap;
+    int current;   //[0,current)已生效，[current,len)可以重做
+    int group;     //最近使用的组号
+    int depth;     //editorUndoBeginGroup的嵌套深度
+    int coalesce;  //下一次单字符编辑能否并入上一条记录
+    int replaying; //正在执行撤销重做，不再记录
+    size_t mem, limit;
+};
+/*行信息。行索引的叶子按字段分别存放各行，editorRow取出的是一份视图，
+内联的短行的chars指向叶子内部，修改行索引后失效*/
 typedef struct erow
 {
     int size;
-    int rsize; //实际大小（包括了不显示的字符）
+    int cap; //chars的容量，为0时chars引用只读的原始文本，内联存放的短行为ROW_INLINE
     char *chars;
-    char *render; //实际渲染
 } erow;
+//slab分配器的一个大小类：空闲链表，以及当前块中还没切出去的部分
+typedef struct slabClass
+{
+    void *free;
+    char *cur;
+    size_t left;
+    long long inuse; //已分配出去的个数
+} slabClass;
+//行文本和渲染缓冲区的分配器，只在主线程中使用
+struct slabState
+{
+    slabClass cls[KILO_SLAB_CLASSES];
+    /*向系统申请的块，关闭缓冲区时整体释放。第i块记在dir[i / KILO_SLAB_DIR]页中，
+    记下的块不会移动，查找线程可以同时用句柄读取行*/
+    char **dir[KILO_SLAB_DIR];
+    int nblocks;
+    long long allocs, frees;
+    long long large, largebytes; //超过KILO_SLAB_MAX直接malloc的个数和字节数
+    int off;                     //为1时直接用malloc/free，性能测试中作对照
+};
+//行内的一个制表符：在chars中的位置，以及展开后下一个字符的渲染位置
+typedef struct tabStop
+{
+    int cx;
+    int rx;
+} tabStop;
+//渲染缓存的一项，以行号为键。只缓存含制表符的行
+typedef struct renderEntry
+{
+    int row;           //缓存的行号，-1表示空闲
+    int rsize;         //实际大小（包括了不显示的字符）
+    char *render;      //实际渲染，为NULL表示行修改后还没有重新生成
+    tabStop *tabs;     //行内所有制表符，按位置升序，修改行时随之更新
+    int ntabs, tabcap; //制表符个数和tabs的容量
+    int hnext;         //哈希链中的下一项
+    int prev, next;    //LRU链表
+} renderEntry;
+#define RENDER_HASH_SIZE 1024
+struct renderCache
+{
+    renderEntry *e;
+    int cap;
+    int head, tail; //最近使用、最久未用
+    int hash[RENDER_HASH_SIZE];
+};
+//可附加缓冲区。复制进来的内容放在b中，引用的内容不复制，
+//输出时按段（abSeg）用writev一次写出
+typedef struct abSeg
+{
+    const char *p; //引用的内容，为NULL时表示b中从off开始的内容
+    int off;
+    int len;
+} abSeg;
+struct abuf
+{
+    char *b; //追加的内容
+    int len; //追加的长度
+    int cap;
+    abSeg *seg; //输出的各段
+    int nseg;
+    int segcap;
+};
+
+#define ABUF_INIT                \
+    {                            \
+        NULL, 0, 0, NULL, 0, 0   \
+    }
+//上一帧中屏幕的一行
+typedef struct screenLine
+{
+    char *b;
+    int len;
+    int cap;
+    int cols; //显示的列数，决定新内容是否需要清除行尾；含非ASCII字符时为-1
+} screenLine;
+//上一帧的屏幕内容，刷新时只输出变化的部分
+struct frameState
+{
+    struct abuf out;  //输出缓冲区，在各帧之间复用
+    screenLine *line; //屏幕每一行（文本行、状态栏、信息栏）
+    int lines;
+    int valid;          //为0时终端内容未知，需要整屏重绘
+    int rowoff, coloff; //上一帧的偏移，用于判断能否滚动
+    int bytes;          //上一帧写出的字节数
+    long long total;    //累计写出的字节数与帧数
+    long long frames;
+    struct timespec last; //上一帧的时间
+    int queued;           //上一帧之后已处理的输入事件数
+    int events;           //合并到上一帧的输入事件数
+    long long allevents;  //累计的输入事件数
+};
+/*行索引B+树的节点。rowInner和rowLeaf都以rowNode开头，
+rows和bytes缓存整棵子树的行数与字节数*/
+#define ROW_FANOUT 64
+#define ROW_MAXDEPTH 16
+typedef struct rowNode
+{
+    int leaf; //是否为叶子
+    int n;    //子节点数，叶子中为行数
+    int rows;
+    long long bytes;
+} rowNode;
+
+typedef struct rowInner
+{
+    rowNode h;
+    rowNode *child[ROW_FANOUT];
+} rowInner;
+
+#define ROW_INLINE 4 //不超过这个长度的修改过的行直接存放在叶子中
+
+//叶子中一行的文本位置，含义由叶子的owned、heap和行长决定
+typedef union rowText
+{
+    int off;            //引用原始文本的行：相对于叶子base的偏移
+    char s[ROW_INLINE]; //内联的短行
+    unsigned h;         //slab中的行：slabHandle，容量是行长所在的大小类
+    int cap;            //单独分配的大行：heap中缓冲区的容量
+} rowText;
+
+/*叶子按字段分别存放各行（结构数组）：行长是连续的数组，统计字节数、按偏移定位时只扫描它。
+每行只占8字节，没有修改过的行不另外分配内存，修改过的短行内联存放，其余的行只多占slab中的空间*/
+typedef struct rowLeaf
+{
+    rowNode h;
+    unsigned long long owned; //第i位为1：第i行已复制，否则引用原始文本
+    unsigned long long plain; //第i位为1：已知第i行没有制表符，渲染与chars相同
+    char *base;
+    char **heap; //超过KILO_SLAB_MAX的行的缓冲区，叶子中有这样的行时才分配
+    int size[ROW_FANOUT];
+    rowText text[ROW_FANOUT];
+} rowLeaf;
+
+//从根到叶子的查找路径
+typedef struct rowPath
+{
+    rowInner *node[ROW_MAXDEPTH];
+    int idx[ROW_MAXDEPTH];
+    int depth;
+} rowPath;
+
+//一块原始文本切分出的行
+typedef struct loadChunk
+{
+    char *start, *end; //块内的行都以换行结尾，只有文件的最后一行例外
+    rowLeaf **leaves;  //切分出的行直接填进叶子，合并时整片挂到行索引上
+    int n, cap;
+    pthread_t tid;
+} loadChunk;
+
+//后台切分线程与主线程共享的状态，由lock保护
+struct loaderState
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int active;       //后台线程是否仍在切分
+    loadChunk *queue; //已切分、等待主线程合并的块
+    int qlen, qcap;
+};
+
+/*当前查找的匹配索引与查找线程池。前from行的匹配按位置排序保存在match中，
+其余的行由工作线程分块扫描。除标明的字段外都由lock保护*/
+struct searchState
+{
+    pthread_mutex_t lock;
+    pthread_cond_t work; //有新的块可以领取
+    pthread_cond_t done; //有块扫描完成或工作线程空闲
+    pthread_t *tid;
+    int nthreads;
+    int gen;            //任务编号，取消或开始新的扫描时加1
+    int running;        //正在扫描的工作线程数
+    int active;         //以下字段只由主线程修改，扫描进行中工作线程只读
+    searchPattern sp;   //当前查找的模式
+    int regex;          //查找输入框中是否按正则表达式查找
+    regexCache rc;      //主线程的DFA缓存
+    searchMatch *match; //前from行的全部匹配
+    int nmatch, matchcap;
+    int from;
+    searchMatch *cand; //细化查找时待验证的原匹配，candend之前的行只验证这些位置
+    int ncand, candend;
+    int scanning;     //正在扫描[from, numrows)
+    rowLeaf **leaves; //扫描开始时这些行所在的叶子及其第一行的行号
+    int *leafstart;
+    int nleaves, leafcap;
+    int numrows;
+    searchBlock *block;
+    int nblocks;
+    int ndone;      //已完成的块数
+    int next;       //下一个要领取的块的序号
+    int start, dir; //从start块开始，按dir方向领取
+    int lastdone;   //上次刷新时已完成的块数
+    int pending;    //等待跳转：从(prow, pcol)沿pdir方向最近的匹配还没有确定
+    int prow, pcol, pdir;
+};
+//底部输入框的状态，按键由主循环的editorProcessKeypress分发
+struct promptState
+{
+    int active;
+    const char *fmt; //提示格式，%s处显示输入内容
+    char *buf;
+    size_t len, cap;
+    void (*callback)(char *, int);
+    void (*done)(char *); //确认或取消后调用，参数为输入内容（取消时为NULL），由它释放
+    int cx, cy, coloff, rowoff; //打开输入框时的光标和窗口位置
+};
+/*后台保存的状态。快照建立后只由保存线程读取，written、done和err由保存线程写，
+其余字段只由主线程访问*/
+struct saveState
+{
+    int running;  //有保存尚未回收
+    int threaded; //保存在后台线程tid中进行
+    int again;    //保存期间又要求保存，完成后再保存一次
+    pthread_t tid;
+    int method;       //本次的保存方式
+    long long offset; //快照从文件的这个偏移开始写
+    long long size;   //保存后的文件总长
+    long long head, tail; //建立快照前的savehead和savetail，保存失败时恢复
+    char *filename;
+    char *tmpname;
+    struct iovec *seg; //快照：依次写出的片段，引用原始文本或chunk中的副本
+    int nseg, segcap;
+    char **chunk; //修改过的行（连同换行）的副本
+    int nchunk;
+    size_t chunkused;
+    size_t total;
+    int dirty;      //建立快照时的修改计数
+    int lastpct;    //上次显示的进度
+    size_t written; //已写入临时文件的字节数
+    int done;
+    int err;        //失败时的errno
+    struct stat st; //保存后的文件信息
+};
+//日志文件头：日志基于的磁盘文件，打开时与磁盘上的文件比较
+typedef struct journalHeader
+{
+    char magic[8];
+    long long size, ino, sec, nsec;
+} journalHeader;
+//日志记录，之后是len字节的文本和校验和
+enum journalType
+{
+    JOURNAL_INSERT = 1, //在(a行,b列)插入文本
+    JOURNAL_DELETE,     //从(a行,b列)删除len个字符，文本是被删除的内容
+    JOURNAL_SPLICE,     //把偏移a开始、到末尾b字节之前的部分换成文本（压缩后的日志）
+    JOURNAL_REPLACE     //把(a行,b列)起的若干字符换成文本，文本前是被替换的长度（int）
+};
+typedef struct journalRecord
+{
+    int type;
+    int len;
+    long long a, b;
+} journalRecord;
+//崩溃恢复日志。buf、len、cap、flush、reset、busy由lock保护，由后台线程写出
+struct journalState
+{
+    pthread_mutex_t lock;
+    pthread_cond_t cond; //有记录要写出
+    pthread_cond_t done; //后台线程写完一批
+    int active;          //后台线程已启动
+    int fd;              //日志文件，-1表示还没有创建
+    int failed;          //无法创建日志，不再记录
+    char *path;
+    char *buf; //还没写出的记录
+    size_t len, cap;
+    int flush, reset, busy;
+    int saving; //保存期间的记录同时放进since，保存成功后成为新日志的内容
+    char *since;
+    size_t sincelen, sincecap;
+    size_t size;          //日志文件写完后的长度
+    struct timespec last; //最后一次追加记录的时间
+    int idle;             //空闲后已经要求写盘
+    int replaying;        //正在恢复，不记录
+    char *recover;        //等待回答是否恢复的日志内容，其中有nrecover条完整记录，到recoverend为止
+    int nrecover;
+    size_t recoverend;
+};
+/*终端输入：每次把所有可读的字节读进环形缓冲，按键从缓冲中解析。
+等待输入时用poll同时等待终端和唤醒管道，后台线程完成工作或收到信号时向管道写一个字节*/
+struct inputState
+{
+    char buf[KILO_INPUT_BUF];
+    unsigned head, tail; //读、写位置，只增不减，取模后得到下标
+    int wake[2];         //唤醒管道，两端都不阻塞
+    int esctimeout;      //由MINIVIM_ESCDELAY环境变量设置
+    char *paste;         //最近一次括号粘贴的内容，换行已统一为\n
+    int pastelen, pastecap;
+    volatile sig_atomic_t resized; //收到SIGWINCH，需要重新取得窗口大小
+};
 //全局变量，编辑器参数
-typedef struct editorConfig
+struct editorConfig
 {
     int cx, cy;     //光标坐标
     int rx;         //制表符行坐标，没有制表符时一切与cx相同
@@ -62,22 +553,80 @@ typedef struct editorConfig
     int screenrows; //窗口的行数
     int screencols; //窗口的列数
     int numrows;    //行总数
-    erow *row;
+    rowNode *rowroot;  //行索引B+树的根
+    rowLeaf *rowleaf;  //最近访问的叶子，加速顺序访问
+    int rowleafstart;  //该叶子第一行的行号
+    char *orig;     //打开文件时映射或读入的原始文本，行在修改前直接引用它
+    size_t origlen;
+    size_t origscan; //原始文本中已切分成行的字节数
+    int origmapped;  //原始文本是否为mmap映射
+    dev_t origdev;   //映射文件的设备号与inode，就地保存时判断是否在改写映射的文件
+    ino_t origino;
+    int loadthreads; //并行切分文件使用的线程数
+    struct loaderState load;
+    struct searchState search;
+    struct promptState prompt;
+    struct saveState save;
+    struct journalState journal;
+    struct inputState input;
+    struct slabState slab;
+    int savemode;       //SAVE_DELTA或SAVE_ATOMIC，由MINIVIM_SAVE环境变量选择
+    struct stat disk;   //上次打开或保存后磁盘上的文件，diskvalid为0时没有可比较的文件
+    int diskvalid;
+    long long savehead; //缓冲区开头的savehead字节与磁盘上的文件相同
+    long long savetail; //已切分部分末尾的savetail字节与磁盘上对应的部分相同
     int dirty; //文件修改程度，保存文件就置为0
     char *filename;
     char statusmsg[80];    //状态信息
     time_t statusmsg_time; //状态信息显示时间长度
+    struct undoLog undo;
+    struct renderCache rcache;
+    struct frameState frame;
+    int debug; //设置了MINIVIM_DEBUG环境变量时在状态栏显示调试计数
     struct termios orig_termios;
-} SElemType;
+};
 
 struct editorConfig E;
-int tmp = 0;
 /*** prototypes ***/
 
 void editorSetStatusMessage(const char *fmt, ...);
+void editorFreeRow(rowLeaf *leaf, int i);
+void editorLoadRows(int rows);
+void editorLoadAll();
+int editorLoaded();
+int editorLoadMerge(int wait);
+int editorLoadPercent();
+void editorUndoPush(int type, int at, int col, const char *s, int len);
+void editorUndoPushReplace(int at, int col, const char *old, int oldlen, const char *s, int len);
+void editorUndoBeginGroup();
+void editorUndoEndGroup();
 void editorRefreshScreen();
+void editorRenderShift(int at, int delta);
+void editorSearchClear();
+void editorSearchEditBegin();
+void editorSearchEditEnd(int at, int oldrows, int newrows);
+int editorSearchPoll();
+int editorSearchJump(int wait);
+void editorSave();
+int editorSavePoll(int wait);
+void editorSaveTouch(int first, int last);
+void editorJournalAppend(int type, long long a, long long b, const char *s, int n);
+void editorJournalAppendReplace(int at, int col, int oldlen, const char *s, int len);
+void editorJournalPoll();
+int editorJournalTimeout();
+void editorJournalOpen();
+void editorJournalRecover(char *answer);
+void editorJournalSaveBegin();
+void editorJournalSaveEnd(int ok);
+int searchCompile(searchPattern *sp, const char *p, int len, int regex);
+void searchFree(searchPattern *sp);
+int searchNext(const searchPattern *sp, const char *s, int n, int from);
+void searchPush(searchMatch **m, int *n, int *cap, int row, int col, int len);
 //char *editorPrompt(char *prompt); change!
-char *editorPrompt(char *prompt, void (*callback)(char *, int));
+void editorPrompt(const char *prompt, void (*callback)(char *, int), void (*done)(char *));
+void editorStep();
+void editorProcessInput();
+int editorResize();
 
 /*** terminal ***/
 
@@ -95,7 +644,9 @@ void die(const char *s)
 }
 //回到原始模式
 void disableRawMode()
-{ //报错
+{ //关闭括号粘贴模式
+    write(STDOUT_FILENO, "\x1b[?2004l", 8);
+    //报错
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1)
         die("tcsetattr");
 }
@@ -113,96 +664,267 @@ void enableRawMode()
     raw.c_oflag &= ~(OPOST); //关闭输出
     raw.c_cflag |= (CS8);
     raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG); //关闭回显，经典模式
-    raw.c_cc[VMIN] = 0;
-    raw.c_cc[VTIME] = 1;
+    //只在poll报告可读后才read，读到已有的字节就返回
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
     //将修改好的raw模式传入终端属性
     if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1)
         //报错
         die("tcsetattr");
+    //开启括号粘贴模式：终端用ESC[200~和ESC[201~包围粘贴的内容
+    write(STDOUT_FILENO, "\x1b[?2004h", 8);
 }
 
-//按键读取，处理转义序列，返回按键的处理后的输入
-int editorReadKey()
+//从since到现在经过的毫秒数
+long editorElapsed(const struct timespec *since)
 {
-    int nread;
-    char c;
-    while ((nread = read(STDIN_FILENO, &c, 1)) != 1)
-    { //检测读取是否成功
-        if (nread == -1 && errno != EAGAIN)
-            die("read");
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - since->tv_sec) * 1000 + (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+//唤醒等待输入的主循环。后台线程和信号处理函数都可以调用；性能测试没有管道时什么也不做
+void editorWake()
+{
+    int saved = errno;
+    if (E.input.wake[1] > 0)
+        write(E.input.wake[1], "", 1);
+    errno = saved;
+}
+
+//窗口大小改变，主循环醒来后重新取得大小
+void editorHandleWinch(int sig)
+{
+    (void)sig;
+    E.input.resized = 1;
+    editorWake();
+}
+
+//建立唤醒管道，设置ESC超时，安装SIGWINCH处理函数
+void editorInputInit()
+{
+    struct inputState *I = &E.input;
+    const char *delay = getenv("MINIVIM_ESCDELAY");
+    I->esctimeout = delay ? atoi(delay) : KILO_ESC_TIMEOUT;
+    if (I->esctimeout < 0)
+        I->esctimeout = 0;
+    if (pipe2(I->wake, O_NONBLOCK | O_CLOEXEC) == -1)
+        die("pipe");
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = editorHandleWinch;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    sigaction(SIGWINCH, &sa, NULL);
+}
+
+/*等待终端输入或唤醒，最多timeout毫秒（-1为一直等待）。
+终端可读时一次读入所有可读的字节（最多到缓冲区末尾），返回读到的字节数*/
+int editorInputFill(int timeout)
+{
+    struct inputState *I = &E.input;
+    unsigned room = KILO_INPUT_BUF - (I->tail - I->head);
+    struct pollfd fds[2];
+    fds[0].fd = room ? STDIN_FILENO : -1; //缓冲区满时只等待唤醒
+    fds[0].events = POLLIN;
+    fds[1].fd = I->wake[0];
+    fds[1].events = POLLIN;
+    if (poll(fds, 2, timeout) <= 0)
+        return 0;
+    if (fds[1].revents & POLLIN)
+    { //唤醒只是让主循环再检查一次后台任务，清空管道即可
+        char drain[64];
+        while (read(I->wake[0], drain, sizeof(drain)) > 0)
+            ;
+    }
+    if (!(fds[0].revents & (POLLIN | POLLHUP | POLLERR)))
+        return 0;
+    unsigned at = I->tail & (KILO_INPUT_BUF - 1);
+    unsigned n = KILO_INPUT_BUF - at < room ? KILO_INPUT_BUF - at : room;
+    ssize_t nread = read(STDIN_FILENO, I->buf + at, n);
+    if (nread <= 0)
+    {
+        if (nread == -1 && (errno == EAGAIN || errno == EINTR))
+            return 0;
+        die("read");
     }
+    I->tail += nread;
+    return nread;
+}
 
-    if (c == '\x1b')
+//缓冲区中第i个未读字节，不足时最多等待timeout毫秒，仍没有到达时返回-1
+int editorInputPeek(unsigned i, int timeout)
+{
+    struct inputState *I = &E.input;
+    if (I->tail - I->head <= i && timeout > 0)
     {
-        char seq[3];
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        long left = timeout;
+        while (I->tail - I->head <= i && left > 0)
+        {
+            editorInputFill(left);
+            left = timeout - editorElapsed(&start);
+        }
+    }
+    if (I->tail - I->head <= i)
+        return -1;
+    return (unsigned char)I->buf[(I->head + i) & (KILO_INPUT_BUF - 1)];
+}
 
-        if (read(STDIN_FILENO, &seq[0], 1) != 1)
-            return '\x1b';
-        if (read(STDIN_FILENO, &seq[1], 1) != 1)
-            return '\x1b';
+//是否有还没处理的输入，缓冲区为空时最多等待timeout毫秒
+int editorInputPending(int timeout)
+{
+    return E.input.head != E.input.tail || editorInputFill(timeout) > 0;
+}
 
-        if (seq[0] == '[')
+//取出一个字节，最多等待timeout毫秒，超时返回-1
+int editorInputGet(int timeout)
+{
+    int c = editorInputPeek(0, timeout);
+    if (c != -1)
+        E.input.head++;
+    return c;
+}
+
+/*解析缓冲区开头ESC开始的转义序列，*len为序列的长度。后续字节在esctimeout毫秒内
+没有到达时是单独的ESC；无法识别的完整序列返回-1*/
+int editorParseEscape(int *len)
+{
+    int timeout = E.input.esctimeout;
+    int c = editorInputPeek(1, timeout);
+    *len = 1;
+    if (c == '[')
+    { //CSI序列：参数字节在0x30-0x3f之间，以0x40-0x7e之间的字节结束，只用第一个参数
+        int i = 2, param = 0, first = 1;
+        while ((c = editorInputPeek(i, timeout)) >= 0x30 && c <= 0x3f && i < 32)
         {
-            if (seq[1] >= '0' && seq[1] <= '9')
-            {
-                if (read(STDIN_FILENO, &seq[2], 1) != 1)
-                    return '\x1b';
-                if (seq[2] == '~')
-                {
-                    switch (seq[1])
-                    {
-                    case '1':
-                        return HOME_KEY;
-                    case '3':
-                        return DEL_KEY;
-                    case '4':
-                        return END_KEY;
-                    case '5':
-                        return PAGE_UP;
-                    case '6':
-                        return PAGE_DOWN;
-                    case '7':
-                        return HOME_KEY;
-                    case '8':
-                        return END_KEY;
-                    }
-                }
-            }
-            else
-            {
-                switch (seq[1])
-                {
-                case 'A':
-                    return ARROW_UP;
-                case 'B':
-                    return ARROW_DOWN;
-                case 'C':
-                    return ARROW_RIGHT;
-                case 'D':
-                    return ARROW_LEFT;
-                case 'H':
-                    return HOME_KEY;
-                case 'F':
-                    return END_KEY;
-                }
-            }
+            if (c == ';')
+                first = 0;
+            else if (first && isdigit(c) && param < 1000)
+                param = param * 10 + c - '0';
+            i++;
         }
-        else if (seq[0] == 'O')
+        if (c < 0x40 || c > 0x7e)
+            return '\x1b';
+        *len = i + 1;
+        switch (c)
         {
-            switch (seq[1])
+        case 'A':
+            return ARROW_UP;
+        case 'B':
+            return ARROW_DOWN;
+        case 'C':
+            return ARROW_RIGHT;
+        case 'D':
+            return ARROW_LEFT;
+        case 'H':
+            return HOME_KEY;
+        case 'F':
+            return END_KEY;
+        case '~':
+            switch (param)
             {
-            case 'H':
+            case 1:
+            case 7:
                 return HOME_KEY;
-            case 'F':
+            case 3:
+                return DEL_KEY;
+            case 4:
+            case 8:
                 return END_KEY;
+            case 5:
+                return PAGE_UP;
+            case 6:
+                return PAGE_DOWN;
+            case 200:
+                return PASTE_KEY;
             }
         }
+        return -1;
+    }
+    if (c == 'O')
+    {
+        c = editorInputPeek(2, timeout);
+        if (c == -1)
+            return '\x1b';
+        *len = 3;
+        if (c == 'H')
+            return HOME_KEY;
+        if (c == 'F')
+            return END_KEY;
+        return -1;
+    }
+    return '\x1b';
+}
 
-        return '\x1b';
+/*读取括号粘贴的内容，直到结束标记ESC[201~。\r\n和单独的\r换成\n，
+结果放在E.input.paste中*/
+void editorReadPaste()
+{
+    struct inputState *I = &E.input;
+    int c, cr = 0;
+    I->pastelen = 0;
+    while ((c = editorInputGet(KILO_PASTE_TIMEOUT)) != -1)
+    {
+        if (c == '\x1b' && editorInputPeek(0, KILO_PASTE_TIMEOUT) == '[' &&
+            editorInputPeek(1, KILO_PASTE_TIMEOUT) == '2' &&
+            editorInputPeek(2, KILO_PASTE_TIMEOUT) == '0' &&
+            editorInputPeek(3, KILO_PASTE_TIMEOUT) == '1' &&
+            editorInputPeek(4, KILO_PASTE_TIMEOUT) == '~')
+        {
+            I->head += 5;
+            break;
+        }
+        if (c == '\n' && cr)
+        {
+            cr = 0;
+            continue;
+        }
+        cr = c == '\r';
+        if (cr)
+            c = '\n';
+        if (I->pastelen == I->pastecap)
+        {
+            I->pastecap = I->pastecap ? I->pastecap * 2 : 4096;
+            I->paste = realloc(I->paste, I->pastecap);
+        }
+        I->paste[I->pastelen++] = c;
     }
-    else
+}
+
+/*按键读取，处理转义序列，返回按键的处理后的输入。
+缓冲区为空时合并后台任务的结果，然后在poll中等待输入或唤醒，空闲时不占用CPU*/
+int editorReadKey()
+{
+    struct inputState *I = &E.input;
+    while (1)
     {
-        return c;
+        while (I->head == I->tail)
+        {
+            if (I->resized && editorResize() == 0)
+                editorRefreshScreen();
+            //等待按键时合并后台切分好的行，刷新行数和进度
+            if (editorLoadMerge(0) | editorSearchPoll() | editorSavePoll(0))
+                editorRefreshScreen();
+            editorJournalPoll();
+            //没有待写的日志时一直等到输入或后台线程唤醒
+            editorInputFill(editorJournalTimeout());
+        }
+        int c = editorInputPeek(0, 0);
+        if (c != '\x1b')
+        {
+            I->head++;
+            return c;
+        }
+        int len;
+        int key = editorParseEscape(&len);
+        I->head += len;
+        if (key == PASTE_KEY)
+            editorReadPaste();
+        //不认识的序列整个丢弃
+        if (key != -1)
+            return key;
     }
 }
 /*获得光标坐标，用指针传值
@@ -218,8 +940,10 @@ int getCursorPosition(int *rows, int *cols)
     //将光标坐标写入buf
     while (i < sizeof(buf) - 1)
     {
-        if (read(STDIN_FILENO, &buf[i], 1) != 1)
+        int c = editorInputGet(KILO_REPLY_TIMEOUT);
+        if (c == -1)
             break;
+        buf[i] = c;
         if (buf[i] == 'R')
             break;
         i++;
@@ -257,1094 +981,6226 @@ int getWindowSize(int *rows, int *cols)
     }
 }
 
-/*** row operations ***/
-//将cx转换为rx
-int editorRowCxToRx(erow *row, int cx)
+/*** slab ***/
+/*行文本和渲染缓冲区按2的幂分成KILO_SLAB_MIN到KILO_SLAB_MAX的大小类，每类从
+KILO_SLAB_BLOCK大小的块中切出固定大小的空间，释放后挂在该类的空闲链表上复用，
+分配和释放都是几条指令。行的容量就是大小类，按倍数增长时换到下一类。
+更大的直接malloc。关闭缓冲区时所有块一起释放，不必逐行free。
+块按自身的大小对齐，块首记下块的编号，块中的空间可以用32位的句柄（块编号和块内偏移）表示，
+行索引的叶子中只保存句柄*/
+
+//n向上取整到所在的大小类，超过KILO_SLAB_MAX时不变
+size_t slabRound(size_t n)
 {
-    int rx = 0;
-    int j;
-    for (j = 0; j < cx; j++)
-    { //强制对齐到制表符结尾
-        if (row->chars[j] == '\t')
-            rx += (KILO_TAB_STOP - 1) - (rx % KILO_TAB_STOP);
-        rx++;
-    }
-    return rx;
+    size_t c = KILO_SLAB_MIN;
+    if (n > KILO_SLAB_MAX)
+        return n;
+    while (c < n)
+        c *= 2;
+    return c;
 }
 
-//将rx转换为cx
-int editorRowRxToCx(erow *row, int rx)
+//大小类的编号
+int slabClassOf(size_t n)
 {
-    int cur_rx = 0;
-    int cx;
-    for (cx = 0; cx < row->size; cx++)
+    int i = 0;
+    size_t c = KILO_SLAB_MIN;
+    while (c < n)
     {
-        if (row->chars[cx] == '\t')
-            cur_rx += (KILO_TAB_STOP - 1) - (cur_rx % KILO_TAB_STOP);
-        cur_rx++;
-
-        if (cur_rx > rx)
-            return cx;
+        c *= 2;
+        i++;
     }
-    return cx;
+    return i;
 }
 
-//将每行的文本转化为实际渲染（处理制表符）
-void editorUpdateRow(erow *row)
+//向系统申请一块按KILO_SLAB_BLOCK对齐的空间：多映射一块，再去掉两端不对齐的部分
+char *slabMapBlock()
 {
-    int tabs = 0;
-    int j;
-    //找出有多少个制表符
-    for (j = 0; j < row->size; j++)
-        if (row->chars[j] == '\t')
-            tabs++;
-    //分配每行的实际大小
-    free(row->render);
-    row->render = malloc(row->size + tabs * (KILO_TAB_STOP - 1) + 1);
+    char *p = mmap(NULL, 2 * KILO_SLAB_BLOCK, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                   -1, 0);
+    if (p == MAP_FAILED)
+        die("mmap");
+    size_t head = -(uintptr_t)p & (KILO_SLAB_BLOCK - 1);
+    if (head)
+        munmap(p, head);
+    munmap(p + head + KILO_SLAB_BLOCK, KILO_SLAB_BLOCK - head);
+    return p + head;
+}
 
-    int idx = 0;
-    for (j = 0; j < row->size; j++)
+//分配n字节，释放时用slabFree并传入同样的n（或slabRound(n)）
+void *slabAlloc(size_t n)
+{
+    struct slabState *A = &E.slab;
+    A->allocs++;
+    if (A->off)
+        return malloc(n);
+    if (n > KILO_SLAB_MAX)
     {
-        //在指标符处，向实际行字符串中添加空格，直到8的倍数
-        if (row->chars[j] == '\t')
-        {
-            row->render[idx++] = ' ';
-            while (idx % KILO_TAB_STOP != 0)
-                row->render[idx++] = ' ';
-        }
-        else
-        {
-            row->render[idx++] = row->chars[j];
-        }
+        A->large++;
+        A->largebytes += n;
+        return malloc(n);
+    }
+    size_t size = slabRound(n);
+    slabClass *c = &A->cls[slabClassOf(size)];
+    c->inuse++;
+    if (c->free)
+    {
+        void *p = c->free;
+        c->free = *(void **)p;
+        return p;
+    }
+    if (c->left < size)
+    { //当前块用完，申请新块。句柄最多能表示KILO_SLAB_DIR * KILO_SLAB_DIR块
+        if (A->nblocks == KILO_SLAB_DIR * KILO_SLAB_DIR)
+            die("slab");
+        char ***page = &A->dir[A->nblocks / KILO_SLAB_DIR];
+        if (*page == NULL)
+            *page = malloc(sizeof(char *) * KILO_SLAB_DIR);
+        char *block = slabMapBlock();
+        *(int *)block = A->nblocks;
+        (*page)[A->nblocks % KILO_SLAB_DIR] = block;
+        A->nblocks++;
+        c->cur = block + KILO_SLAB_MIN;
+        c->left = KILO_SLAB_BLOCK - KILO_SLAB_MIN;
     }
-    row->render[idx] = '\0';
-    row->rsize = idx;
+    void *p = c->cur;
+    c->cur += size;
+    c->left -= size;
+    return p;
 }
 
-//插入行
-void editorInsertRow(int at, char *s, size_t len)
-{ //检测坐标在文本内
-    if (at < 0 || at > E.numrows)
+void slabFree(void *p, size_t n)
+{
+    struct slabState *A = &E.slab;
+    if (p == NULL)
         return;
-    //重新分配行信息数组
-    E.row = realloc(E.row, sizeof(erow) * (E.numrows + 1));
-    memmove(&E.row[at + 1], &E.row[at], sizeof(erow) * (E.numrows - at));
-    //重建第at行
-    E.row[at].size = len;
-    E.row[at].chars = malloc(len + 1);
-    memcpy(E.row[at].chars, s, len);
-    E.row[at].chars[len] = '\0';
-
-    E.row[at].rsize = 0;
-    E.row[at].render = NULL;
-    //更新第at行的实际渲染
-    editorUpdateRow(&E.row[at]);
-
-    E.numrows++;
-    E.dirty++;
+    A->frees++;
+    if (A->off || n > KILO_SLAB_MAX)
+    {
+        if (!A->off)
+        {
+            A->large--;
+            A->largebytes -= n;
+        }
+        free(p);
+        return;
+    }
+    slabClass *c = &A->cls[slabClassOf(slabRound(n))];
+    c->inuse--;
+    *(void **)p = c->free;
+    c->free = p;
 }
 
-void editorFreeRow(erow *row)
+//把p从old字节改为n字节，保留前面的内容
+void *slabRealloc(void *p, size_t old, size_t n)
 {
-    free(row->render);
-    free(row->chars);
+    struct slabState *A = &E.slab;
+    if (A->off || (old > KILO_SLAB_MAX && n > KILO_SLAB_MAX))
+    {
+        if (!A->off)
+            A->largebytes += n - old;
+        return realloc(p, n);
+    }
+    if (slabRound(old) == slabRound(n))
+        return p;
+    void *q = slabAlloc(n);
+    memcpy(q, p, old < n ? old : n);
+    slabFree(p, old);
+    return q;
 }
 
-//删除一行
-void editorDelRow(int at)
-{ //确定不超出文件范围
-    if (at < 0 || at >= E.numrows)
-        return;
-    editorFreeRow(&E.row[at]);
-    //使用memmove()来用后面的行覆盖被删除的行
-    memmove(&E.row[at], &E.row[at + 1], sizeof(erow) * (E.numrows - at - 1));
-    E.numrows--;
-    E.dirty++;
+//slab中p处空间的句柄
+unsigned slabHandle(void *p)
+{
+    char *block = (char *)((uintptr_t)p & ~(uintptr_t)(KILO_SLAB_BLOCK - 1));
+    return (unsigned)*(int *)block * (KILO_SLAB_BLOCK / KILO_SLAB_MIN) +
+           ((char *)p - block) / KILO_SLAB_MIN;
 }
 
-//在行中插入字符
-void editorRowInsertChar(erow *row, int at, int c)
-{
-    if (at < 0 || at > row->size)
-        at = row->size;
-    //重新分配更大的空间
-    row->chars = realloc(row->chars, row->size + 2);
-    //将at的内容转移到at+1，空出at
-    memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
-    row->size++;
-    //在at处插入字符
-    row->chars[at] = c;
-    editorUpdateRow(row);
-    E.dirty++;
+//句柄h对应的空间
+char *slabPtr(unsigned h)
+{
+    unsigned b = h / (KILO_SLAB_BLOCK / KILO_SLAB_MIN);
+    return E.slab.dir[b / KILO_SLAB_DIR][b % KILO_SLAB_DIR] +
+           (size_t)(h % (KILO_SLAB_BLOCK / KILO_SLAB_MIN)) * KILO_SLAB_MIN;
 }
 
-//在行尾添加字符字符串
-void editorRowAppendString(erow *row, char *s, size_t len)
+//释放所有块。调用者保证其中的空间都已不再使用，单独malloc的大块由调用者释放
+void slabReset()
 {
-    row->chars = realloc(row->chars, row->size + len + 1);
-    memcpy(&row->chars[row->size], s, len);
-    row->size += len;
-    row->chars[row->size] = '\0';
-    editorUpdateRow(row);
-    E.dirty++;
+    struct slabState *A = &E.slab;
+    int i;
+    for (i = 0; i < A->nblocks; i++)
+        munmap(A->dir[i / KILO_SLAB_DIR][i % KILO_SLAB_DIR], KILO_SLAB_BLOCK);
+    A->nblocks = 0;
+    for (i = 0; i < KILO_SLAB_CLASSES; i++)
+        A->cls[i] = (slabClass){NULL, NULL, 0, 0};
 }
-//在行中删除字符
-void editorRowDelChar(erow *row, int at)
+
+//已分配出去的字节数（按大小类取整，含大块）与向系统申请的字节数
+void slabStats(long long *used, long long *reserved)
 {
-    if (at < 0 || at >= row->size)
-        return;
-    //使用memmove()来用后面的字符覆盖被删除的字符
-    memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-    row->size--;
-    editorUpdateRow(row);
-    E.dirty++;
+    struct slabState *A = &E.slab;
+    int i;
+    *used = A->largebytes;
+    for (i = 0; i < KILO_SLAB_CLASSES; i++)
+        *used += A->cls[i].inuse * ((long long)KILO_SLAB_MIN << i);
+    *reserved = (long long)A->nblocks * KILO_SLAB_BLOCK + A->largebytes;
 }
 
-/*** editor operations ***/
-//接受一个字符并使用editorRowInsertChar()将该字符插入到光标所在的位置。
+/*** row index ***/
+/*行索引是一棵计数B+树：叶子按顺序存放行，内部节点缓存每棵子树的行数和字节数
+（每行计入行尾换行），按行号查找、插入删除行、字节偏移与行号互相转换都是O(log n)*/
 
-void editorInsertChar(int c)
+rowNode *rowNodeNew(int leaf)
 {
-    if (E.cy == E.numrows)
+    rowNode *n = malloc(leaf ? sizeof(rowLeaf) : sizeof(rowInner));
+    n->leaf = leaf;
+    n->n = 0;
+    n->rows = 0;
+    n->bytes = 0;
+    if (leaf)
     {
-        editorInsertRow(E.numrows, "", 0);
+        rowLeaf *l = (rowLeaf *)n;
+        l->owned = l->plain = 0;
+        l->base = NULL;
+        l->heap = NULL;
     }
-    editorRowInsertChar(&E.row[E.cy], E.cx, c);
-    E.cx++;
+    return n;
 }
-//处理新建行
-void editorInsertNewline()
+
+//释放节点本身（不包括其中的行）
+void rowNodeFree(rowNode *n)
 {
-    //在行头
-    if (E.cx == 0)
-    {
-        editorInsertRow(E.cy, "", 0);
-    }
-    //在行中按回车
-    else
-    {
-        erow *row = &E.row[E.cy];
-        //新行的内容
-        editorInsertRow(E.cy + 1, &row->chars[E.cx], row->size - E.cx);
-        //截断旧行
-        row = &E.row[E.cy];
-        row->size = E.cx;
-        row->chars[row->size] = '\0';
-        editorUpdateRow(row);
-    }
-    E.cy++;
-    E.cx = 0;
+    if (n->leaf)
+        free(((rowLeaf *)n)->heap);
+    free(n);
 }
-//确定删除字符的位置
-void editorDelChar()
+
+//位图中[0, n)位的掩码
+unsigned long long rowMask(int n)
 {
-    if (E.cy == E.numrows)
-        return;
-    //游标位于开头
-    if (E.cx == 0 && E.cy == 0)
-        return;
-    //确定删除哪一行
-    erow *row = &E.row[E.cy];
-    if (E.cx > 0)
-    {
-        editorRowDelChar(row, E.cx - 1);
-        E.cx--;
-    }
-    //在行头删除
-    else
-    {
-        E.cx = E.row[E.cy - 1].size;
-        //在行尾添加字符字符串
-        editorRowAppendString(&E.row[E.cy - 1], row->chars, row->size);
-        editorDelRow(E.cy);
-        E.cy--;
-    }
+    return n >= 64 ? ~0ULL : (1ULL << n) - 1;
 }
 
-/******************redo&undo******************************/
-/******************redo&undo******************************/
-
-void initSElemType(SElemType **e2) //初始化临时窗口状态
+//行内容的容量：按倍数增长，至少KILO_SLAB_MIN
+int rowCap(int n)
 {
-    *e2 = (SElemType *)malloc(sizeof(SElemType));
+    int c = KILO_SLAB_MIN;
+    while (c < n)
+        c *= 2;
+    return c;
 }
 
-void CopySElemType(SElemType *e2, SElemType *e1)
+//叶子中第i行的视图
+erow rowGet(rowLeaf *leaf, int i)
 {
-    // e2=(SElemType*)malloc(sizeof(SElemType));
-    e2->cx = e1->cx;
-    e2->cy = e1->cy;
-    e2->rx = e1->rx;
-    e2->rowoff = e1->rowoff;
-    e2->coloff = e1->coloff;
-    e2->numrows = e1->numrows;
-
-    e2->row = (erow *)malloc(e1->numrows * sizeof(erow));
-    int i;
-    for (i = 0; i < e1->numrows; i++)
+    erow row = {leaf->size[i], 0, NULL};
+    if (!(leaf->owned >> i & 1))
+        row.chars = leaf->base + leaf->text[i].off;
+    else if (leaf->heap && leaf->heap[i])
+    {
+        row.cap = leaf->text[i].cap;
+        row.chars = leaf->heap[i];
+    }
+    else if (row.size <= ROW_INLINE)
     {
-        e2->row[i].size = e1->row[i].size;
-        e2->row[i].rsize = e1->row[i].rsize;
-        e2->row[i].chars = (char *)malloc(e1->row[i].size * sizeof(char));
-        strcpy(e2->row[i].chars, e1->row[i].chars);
-        e2->row[i].render = (char *)malloc(e1->row[i].size * sizeof(char));
-        strcpy(e2->row[i].render, e1->row[i].render);
+        row.cap = ROW_INLINE;
+        row.chars = leaf->text[i].s;
     }
-    e2->dirty = e1->dirty;
-    e2->filename = (char *)malloc(sizeof(char) * 10);
-    strcpy(e2->filename, e1->filename);
-    e2->screenrows = e1->screenrows;
-    e2->screencols = e1->screencols;
-    //e2->statusmsg = (char*)malloc(80*sizeof(char));
-    strcpy(e2->statusmsg, e1->statusmsg);
-    e2->statusmsg_time = e1->statusmsg_time;
-    e2->orig_termios = e1->orig_termios;
+    else
+    {
+        row.cap = rowCap(row.size);
+        row.chars = slabPtr(leaf->text[i].h);
+    }
+    return row;
 }
 
-typedef struct //保存窗口状态的结构体
-{
-    SElemType *base[STACK_INIT_SIZE]; //指针数组
-    int rear;
-    int current;
-    int flag;
-} SqStack;
-
-SqStack S;
-
-int InitStack(SqStack *S) //初始化结构体
-{
-    int i;
-    for (i = 0; i < STACK_INIT_SIZE; i++)
-        S->base[i] = NULL;
-    S->current = 0;
-    S->rear = 0;
-    S->flag = 0;
-    return 0;
-} //InitStack
-
-void myfree(SElemType *E) //释放空间
+/*第i行改用容量为cap的缓冲区chars。slab中的行只记句柄，容量由行长决定，
+调用者保证cap就是行长（修改完成后）所在的大小类*/
+void rowAdopt(rowLeaf *leaf, int i, char *chars, int cap)
 {
-
-    for (int i = 0; i < E->numrows; i++)
+    leaf->owned |= 1ULL << i;
+    if (cap <= KILO_SLAB_MAX && !E.slab.off)
     {
-        free(E->row[i].chars);
-        free(E->row[i].render);
+        leaf->text[i].h = slabHandle(chars);
+        if (leaf->heap)
+            leaf->heap[i] = NULL;
+        return;
     }
-    free(E->row);
-    free(E->filename);
-    //free(E->statusmsg);
-    free(E);
+    if (leaf->heap == NULL)
+        leaf->heap = calloc(ROW_FANOUT, sizeof(char *));
+    leaf->heap[i] = chars;
+    leaf->text[i].cap = cap;
 }
 
-int AddRecord(SqStack *S) //调用的时候AddRecord(S,&e1),传值，传地址
+/*把r描述的行放到叶子的第i个位置。r->cap为0时引用原始文本，离base太远时改为复制；
+否则复制短行或接管r->chars指向的缓冲区*/
+void rowPut(rowLeaf *leaf, int i, const erow *r)
 {
-    //首先要拷贝当前e的状态
-    SElemType *e2;
-    initSElemType(&e2);
-    CopySElemType(e2, &E);
-    int i;
-    if (S->rear == STACK_INIT_SIZE)
+    leaf->size[i] = r->size;
+    leaf->plain &= ~(1ULL << i);
+    if (leaf->heap)
+        leaf->heap[i] = NULL;
+    if (r->cap == 0 && r->chars)
     {
-        if (tmp == 1)
-        {
-            myfree(S->base[0]);
-        }
-        for (i = 0; i < STACK_INIT_SIZE - 1; i++)
+        if (leaf->base == NULL)
+            leaf->base = r->chars;
+        long long off = r->chars - leaf->base;
+        if (off >= INT_MIN && off + r->size <= INT_MAX)
         {
-            S->base[i] = S->base[i + 1];
+            leaf->owned &= ~(1ULL << i);
+            leaf->text[i].off = off;
+            return;
         }
-        S->base[S->rear - 1] = e2;
     }
-    else
-    {
-        S->base[S->rear] = e2;
-        S->rear = S->rear + 1;
-    }
-
-    S->current = S->rear;
-
-    return 0;
-} //Push入栈操作
-
-void editorUndo()
-{
-    if (S.current <= 0)
+    leaf->owned |= 1ULL << i;
+    if (r->size <= ROW_INLINE)
     {
-        S.current = S.current + STACK_INIT_SIZE;
+        if (r->size)
+            memcpy(leaf->text[i].s, r->chars, r->size);
+        if (r->cap > ROW_INLINE)
+            slabFree(r->chars, r->cap);
+        return;
     }
-    if (S.base[S.current - 1] != NULL && S.flag < STACK_INIT_SIZE)
+    char *chars = r->chars;
+    int cap = rowCap(r->size);
+    if (r->cap == 0)
     {
-        E = *S.base[S.current - 1];
-        S.current--;
-        S.flag++;
+        chars = slabAlloc(cap);
+        memcpy(chars, r->chars, r->size);
     }
-
-    editorSetStatusMessage("undo");
+    else if (r->cap > KILO_SLAB_MAX || E.slab.off)
+        cap = r->cap;
+    else if (r->cap != cap)
+        chars = slabRealloc(chars, r->cap, cap);
+    rowAdopt(leaf, i, chars, cap);
 }
 
-void editorRedo()
+//把src从第si行开始的n行移到dst的第di行处（位置已空出），修改过的行的缓冲区随行转移
+void rowMove(rowLeaf *dst, int di, rowLeaf *src, int si, int n)
 {
-
-    if (S.flag > 1)
+    int k;
+    for (k = 0; k < n; k++)
     {
-        E = *S.base[(S.current + 1) % STACK_INIT_SIZE];
-        S.current = (S.current + 1) % STACK_INIT_SIZE;
-        S.flag--;
-    };
-
-    editorSetStatusMessage("redo");
+        int a = di + k, b = si + k;
+        if (src->owned >> b & 1)
+        {
+            char *p = src->heap ? src->heap[b] : NULL;
+            dst->size[a] = src->size[b];
+            dst->text[a] = src->text[b];
+            dst->owned |= 1ULL << a;
+            if (p && dst->heap == NULL)
+                dst->heap = calloc(ROW_FANOUT, sizeof(char *));
+            if (dst->heap)
+                dst->heap[a] = p;
+        }
+        else
+        {
+            erow r = rowGet(src, b);
+            rowPut(dst, a, &r);
+        }
+        dst->plain = (dst->plain & ~(1ULL << a)) | (src->plain >> b & 1) << a;
+    }
 }
-/*** file i/o ***/
-//将文件内容写入缓冲区
-char *editorRowsToString(int *buflen)
+
+//在叶子的第idx行处空出k行（k>0），或删去从idx开始的-k行（k<0，这些行已释放）
+void rowLeafShift(rowLeaf *leaf, int idx, int k)
 {
-    //得到文件总长
-    int totlen = 0;
+    int from = k > 0 ? idx : idx - k;
+    int to = idx + (k > 0 ? k : 0);
+    int n = leaf->h.n - from;
+    memmove(&leaf->size[to], &leaf->size[from], sizeof(int) * n);
+    memmove(&leaf->text[to], &leaf->text[from], sizeof(rowText) * n);
+    if (leaf->heap)
+        memmove(&leaf->heap[to], &leaf->heap[from], sizeof(char *) * n);
+    unsigned long long *bits[2] = {&leaf->owned, &leaf->plain};
     int j;
-    for (j = 0; j < E.numrows; j++)
-        totlen += E.row[j].size + 1;
-    *buflen = totlen;
-    //分配文件总大小
-    char *buf = malloc(totlen);
-    char *p = buf;
-    //文件内容写入缓冲区，每行结尾添加回车
-    for (j = 0; j < E.numrows; j++)
+    for (j = 0; j < 2; j++)
     {
-        memcpy(p, E.row[j].chars, E.row[j].size);
-        p += E.row[j].size;
-        *p = '\n';
-        p++;
+        unsigned long long b = *bits[j];
+        unsigned long long high = from >= 64 ? 0 : b >> from;
+        *bits[j] = (b & rowMask(idx)) | (to >= 64 ? 0 : high << to);
     }
-
-    return buf;
 }
 
-void editorOpen(char *filename)
-{ //保存路径
-    free(E.filename);
-    E.filename = strdup(filename);
-
-    FILE *fp = fopen(filename, "r");
-    if (!fp)
-        die("fopen");
-
-    char *line = NULL;
-    size_t linecap = 0;
-    ssize_t linelen;
-    //getline：对line指针与行的长度赋值
-    while ((linelen = getline(&line, &linecap, fp)) != -1)
-    { //去掉行位的换行
-        while (linelen > 0 && (line[linelen - 1] == '\n' ||
-                               line[linelen - 1] == '\r'))
-            linelen--;
-        editorInsertRow(E.numrows, line, linelen);
-    }
-    free(line);
-    fclose(fp);
-    E.dirty = 0;
-}
-
-void editorSave()
+//根据子节点重新统计行数和字节数
+void rowNodeRecount(rowNode *n)
 {
-    if (E.filename == NULL)
-    { //change
-        E.filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
-        if (E.filename == NULL)
-        {
-            editorSetStatusMessage("Save aborted");
-            return;
-        }
+    int i;
+    n->rows = 0;
+    n->bytes = 0;
+    if (n->leaf)
+    {
+        rowLeaf *leaf = (rowLeaf *)n;
+        n->rows = n->n;
+        for (i = 0; i < n->n; i++)
+            n->bytes += leaf->size[i] + 1;
     }
-    //文件总长
-    int len;
-    //文件内容缓冲区
-    char *buf = editorRowsToString(&len);
-    //如果文件不存在，我们希望创建一个新文件(O_CREAT)，并希望打开它进行读写(O_RDWR)
-    int fd = open(E.filename, O_RDWR | O_CREAT, 0644);
-    //处理错误
-    if (fd != -1)
+    else
     {
-        if (ftruncate(fd, len) != -1)
+        rowInner *in = (rowInner *)n;
+        for (i = 0; i < n->n; i++)
         {
-            if (write(fd, buf, len) == len)
-            {
-                close(fd);
-                free(buf);
-                E.dirty = 0;
-                editorSetStatusMessage("%d bytes written to disk", len);
-                return;
-            }
+            n->rows += in->child[i]->rows;
+            n->bytes += in->child[i]->bytes;
         }
-        close(fd);
     }
-
-    free(buf);
-    editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
 }
 
-/*** find ***/
-int *KMP(char *s, char *p)
+//从根向下查找第at行所在的叶子并记录路径，*idx返回行在叶子中的位置
+rowLeaf *rowTreeFind(int at, rowPath *path, int *idx)
 {
-    int len = strlen(p);
-    int r = -1;
-    int t = 0;
-    int next[20];
-    next[0] = -1;
-    //	printf("\n j= %d next[0]%d",j,next[j]);
-    while (t < len)
+    if (E.rowroot == NULL)
+        E.rowroot = rowNodeNew(1);
+    rowNode *n = E.rowroot;
+    path->depth = 0;
+    while (!n->leaf)
     {
-        if (r == -1 || p[r] == p[t])
-        {
-            r++;
-            t++;
-            next[t] = r;
-            //			printf("\n j= %d next[%d]%d",j,j,next[j]);
-        }
-        else
+        rowInner *in = (rowInner *)n;
+        int i;
+        for (i = 0; i < n->n - 1; i++)
         {
-            r = next[r];
+            if (at < in->child[i]->rows)
+                break;
+            at -= in->child[i]->rows;
         }
+        path->node[path->depth] = in;
+        path->idx[path->depth] = i;
+        path->depth++;
+        n = in->child[i];
     }
-    int i = 0;
-    int j = 0;
-    int sLen = strlen(s);
-    int pLen = strlen(p);
-    int k = 0;
-    int *res;
-    res = (int *)malloc(sizeof(int) * 20);
-    while (i < sLen && j < pLen)
+    *idx = at;
+    return (rowLeaf *)n;
+}
+
+//修改路径上所有节点的计数
+void rowPathAdd(rowPath *path, rowLeaf *leaf, int rows, long long bytes)
+{
+    int i;
+    for (i = 0; i < path->depth; i++)
     {
-        if (j == -1 || s[i] == p[j])
-        {
-            i++;
-            j++;
-            if (j == pLen)
-            {
-                res[k] = (i - j);
-                k++;
-            }
-        }
-        else
+        path->node[i]->h.rows += rows;
+        path->node[i]->h.bytes += bytes;
+    }
+    leaf->h.rows += rows;
+    leaf->h.bytes += bytes;
+    E.numrows = E.rowroot->rows;
+}
+
+//节点left分裂出right后，把right插入到路径中第level层的父节点，必要时继续向上分裂
+void rowTreeAddChild(rowPath *path, int level, rowNode *left, rowNode *right)
+{
+    if (level == 0)
+    { //根节点分裂，树长高一层
+        rowInner *root = (rowInner *)rowNodeNew(0);
+        root->child[0] = left;
+        root->child[1] = right;
+        root->h.n = 2;
+        rowNodeRecount(&root->h);
+        E.rowroot = &root->h;
+        return;
+    }
+    rowInner *parent = path->node[level - 1];
+    int at = path->idx[level - 1] + 1;
+    if (parent->h.n == ROW_FANOUT)
+    { //在末尾追加时新节点只放新的子节点，保持顺序追加时节点是满的
+        int half = at == ROW_FANOUT ? ROW_FANOUT : ROW_FANOUT / 2;
+        rowInner *sib = (rowInner *)rowNodeNew(0);
+        memcpy(sib->child, &parent->child[half], sizeof(rowNode *) * (ROW_FANOUT - half));
+        sib->h.n = ROW_FANOUT - half;
+        parent->h.n = half;
+        if (at >= half)
         {
-            //②如果j != -1，且当前字符匹配失败（即S[i] != P[j]），则令 i 不变，j = next[j]
-            //next[j]即为j所对应的next值
-            j = next[j];
+            parent = sib;
+            at -= half;
         }
+        memmove(&parent->child[at + 1], &parent->child[at], sizeof(rowNode *) * (parent->h.n - at));
+        parent->child[at] = right;
+        parent->h.n++;
+        rowNodeRecount(&path->node[level - 1]->h);
+        rowNodeRecount(&sib->h);
+        rowTreeAddChild(path, level - 1, &path->node[level - 1]->h, &sib->h);
+        return;
     }
-    res[k] = -1;
-    return res;
+    memmove(&parent->child[at + 1], &parent->child[at], sizeof(rowNode *) * (parent->h.n - at));
+    parent->child[at] = right;
+    parent->h.n++;
 }
-//定义回调函数用于增量查找，对每一种按键都作相应操作
-void editorFindCallback(char *query, int key)
+
+//从父节点中移除第level层的节点，并处理因此变得过空的祖先节点
+void rowTreeRemoveChild(rowPath *path, int level)
 {
-    static int last_match = -1; //上一个匹配字符串序号，初始值为-1
-    static int direction = 1;   //搜索方向
+    rowInner *parent = path->node[level - 1];
+    int at = path->idx[level - 1];
+    rowNodeFree(parent->child[at]);
+    memmove(&parent->child[at], &parent->child[at + 1], sizeof(rowNode *) * (parent->h.n - at - 1));
+    parent->h.n--;
+    if (parent->h.n == 0 && level > 1)
+        rowTreeRemoveChild(path, level - 1);
+}
 
-    //退出时重新初始化值
-    if (key == '\r' || key == '\x1b')
-    {
-        last_match = -1;
-        direction = 1;
+//节点过空时与相邻的兄弟合并，保持树的平衡
+void rowTreeMerge(rowPath *path, int level, rowNode *n)
+{
+    if (level == 0 || n->n >= ROW_FANOUT / 4)
         return;
-    }
-    //方向键控制搜索方向
-    else if (key == ARROW_RIGHT || key == ARROW_DOWN)
-    {
-        direction = 1;
-    }
-    else if (key == ARROW_LEFT || key == ARROW_UP)
+    rowInner *parent = path->node[level - 1];
+    int at = path->idx[level - 1];
+    if (n->n == 0)
     {
-        direction = -1;
+        rowTreeRemoveChild(path, level);
+        return;
     }
+    //与右兄弟合并，没有右兄弟就并入左兄弟
+    int left = at + 1 < parent->h.n ? at : at - 1;
+    if (left < 0)
+        return;
+    rowNode *l = parent->child[left];
+    rowNode *r = parent->child[left + 1];
+    if (l->n + r->n > ROW_FANOUT)
+        return;
+    if (l->leaf)
+        rowMove((rowLeaf *)l, l->n, (rowLeaf *)r, 0, r->n);
     else
+        memcpy(&((rowInner *)l)->child[l->n], ((rowInner *)r)->child, sizeof(rowNode *) * r->n);
+    l->n += r->n;
+    l->rows += r->rows;
+    l->bytes += r->bytes;
+    path->idx[level - 1] = left + 1;
+    r->n = 0;
+    rowTreeRemoveChild(path, level);
+    path->idx[level - 1] = left;
+    rowTreeMerge(path, level - 1, &parent->h);
+}
+
+//根节点只剩一个子节点时降低树高
+void rowTreeShrink()
+{
+    while (!E.rowroot->leaf && E.rowroot->n <= 1)
     {
-        last_match = -1;
-        direction = 1;
+        rowInner *root = (rowInner *)E.rowroot;
+        E.rowroot = root->h.n ? root->child[0] : rowNodeNew(1);
+        free(root);
     }
+    E.numrows = E.rowroot->rows;
+}
 
-    if (last_match == -1)
-        direction = 1;
-    int current = last_match;
-    int i;
-    //行循环搜索
-    for (i = 0; i < E.numrows; i++)
+//把一片填好的叶子接在行索引的最后
+void rowTreeAppendLeaf(rowLeaf *leaf)
+{
+    rowPath path;
+    int idx, i;
+    E.rowleaf = NULL;
+    rowLeaf *last = rowTreeFind(E.numrows, &path, &idx);
+    if (last->h.n == 0)
+    { //空树，叶子直接作为根
+        rowNodeFree(&last->h);
+        E.rowroot = &leaf->h;
+        E.numrows = leaf->h.rows;
+        return;
+    }
+    //先把新叶子的计数加到最右路径上，分裂的节点会重新统计
+    for (i = 0; i < path.depth; i++)
     {
-        current += direction;
-        if (current == -1)
-            current = E.numrows - 1;
-        else if (current == E.numrows)
-            current = 0;
-
-        erow *row = &E.row[current];
-        //char *match = strstr(row->render, query);
-        char *match = NULL;
-        if (KMP(row->render, query)[0] != -1)
-            match = row->render + KMP(row->render, query)[0];
-        if (match)
-        {
-            last_match = current;
-            E.cy = current;
-            E.cx = editorRowRxToCx(row, match - row->render);
-            E.rowoff = E.numrows;
-            break;
-        }
+        path.node[i]->h.rows += leaf->h.rows;
+        path.node[i]->h.bytes += leaf->h.bytes;
     }
+    rowTreeAddChild(&path, path.depth, &last->h, &leaf->h);
+    E.numrows = E.rowroot->rows;
 }
 
-void editorFind()
-{ //保存进入search模式前的光标位置，使退出search时光标重新定位
-    int saved_cx = E.cx;
-    int saved_cy = E.cy;
-    int saved_coloff = E.coloff;
-    int saved_rowoff = E.rowoff;
-    //editorFindCallback作editorPrompt的回调函数（函数作参数）
-    char *query = editorPrompt("Search: %s (Use ESC/Arrows/Enter)",
-                               editorFindCallback);
-
-    if (query)
+//释放整棵行索引树。slab中的行文本由slabReset整体释放，这里只释放单独分配的大行
+void rowTreeFree(rowNode *n)
+{
+    int i;
+    if (n->leaf)
     {
-        free(query);
+        rowLeaf *leaf = (rowLeaf *)n;
+        for (i = 0; i < n->n && leaf->heap; i++)
+            if (leaf->heap[i] && (leaf->text[i].cap > KILO_SLAB_MAX || E.slab.off))
+                editorFreeRow(leaf, i);
     }
     else
     {
-        E.cx = saved_cx;
-        E.cy = saved_cy;
-        E.coloff = saved_coloff;
-        E.rowoff = saved_rowoff;
+        for (i = 0; i < n->n; i++)
+            rowTreeFree(((rowInner *)n)->child[i]);
     }
+    rowNodeFree(n);
 }
 
-/*** replace***/
-//定义字符串替换函数
-char *replaceWord(char *s, char *oldW, char *newW)
+//按行号查找行所在的叶子，*idx返回行在叶子中的位置。顺序访问时直接命中上一次的叶子
+rowLeaf *editorRowLeaf(int at, int *idx)
 {
-    char *result;
-    int i, cnt = 0;
-    int newWlen = strlen(newW);
-    int oldWlen = strlen(oldW);
+    if (E.rowleaf == NULL || at < E.rowleafstart || at >= E.rowleafstart + E.rowleaf->h.n)
+    {
+        rowPath path;
+        E.rowleaf = rowTreeFind(at, &path, idx);
+        E.rowleafstart = at - *idx;
+    }
+    *idx = at - E.rowleafstart;
+    return E.rowleaf;
+}
+
+//按行号取行
+erow editorRow(int at)
+{
+    int i;
+    rowLeaf *leaf = editorRowLeaf(at, &i);
+    return rowGet(leaf, i);
+}
 
-    for (i = 0; s[i] != '\0'; i++)
+//在第at行处插入count行（行内容已填好），在文件末尾追加时整块填满叶子
+void editorInsertRows(int at, erow *rows, int count)
+{
+    if (at < 0 || at > E.numrows)
+        return;
+    if (at < E.numrows)
+        editorRenderShift(at, count);
+    E.rowleaf = NULL;
+    while (count > 0)
     {
-        if (strstr(&s[i], oldW) == &s[i])
+        rowPath path;
+        int idx;
+        rowLeaf *leaf = rowTreeFind(at, &path, &idx);
+        if (leaf->h.n == ROW_FANOUT)
         {
-            cnt++;
-
-            i += oldWlen - 1;
+            rowLeaf *right = (rowLeaf *)rowNodeNew(1);
+            if (at < E.numrows)
+            { //在中间插入，对半分裂
+                int half = ROW_FANOUT / 2;
+                rowMove(right, 0, leaf, half, ROW_FANOUT - half);
+                right->h.n = ROW_FANOUT - half;
+                leaf->h.n = half;
+            }
+            rowNodeRecount(&leaf->h);
+            rowNodeRecount(&right->h);
+            rowTreeAddChild(&path, path.depth, &leaf->h, &right->h);
+            continue;
+        }
+        int k = ROW_FANOUT - leaf->h.n;
+        if (k > count)
+            k = count;
+        rowLeafShift(leaf, idx, k);
+        leaf->h.n += k;
+        long long bytes = 0;
+        int i;
+        for (i = 0; i < k; i++)
+        {
+            rowPut(leaf, idx + i, &rows[i]);
+            bytes += rows[i].size + 1;
         }
+        rowPathAdd(&path, leaf, k, bytes);
+        at += k;
+        rows += k;
+        count -= k;
     }
+}
 
-    //保证足够内存
-    result = (char *)malloc(i + cnt * (newWlen - oldWlen) + 1);
-
-    i = 0;
-    while (*s)
+//删除从第at行开始的count行，同一叶子里的行一次删除
+void editorDelRows(int at, int count)
+{
+    if (at < 0 || count <= 0 || at >= E.numrows)
+        return;
+    if (count > E.numrows - at)
+        count = E.numrows - at;
+    editorRenderShift(at, -count);
+    E.rowleaf = NULL;
+    while (count > 0)
     {
-        if (strstr(s, oldW) == s)
+        rowPath path;
+        int idx;
+        rowLeaf *leaf = rowTreeFind(at, &path, &idx);
+        int k = leaf->h.n - idx;
+        if (k > count)
+            k = count;
+        long long bytes = 0;
+        int i;
+        for (i = idx; i < idx + k; i++)
         {
-            strcpy(&result[i], newW);
-            i += newWlen;
-            s += oldWlen;
+            bytes += leaf->size[i] + 1;
+            editorFreeRow(leaf, i);
         }
-        else
-            result[i++] = *s++;
+        rowLeafShift(leaf, idx, -k);
+        leaf->h.n -= k;
+        rowPathAdd(&path, leaf, -k, -bytes);
+        rowTreeMerge(&path, path.depth, &leaf->h);
+        rowTreeShrink();
+        count -= k;
     }
+    E.dirty++;
+}
 
-    result[i] = '\0';
-    return result;
+//第at行行首在文件中的字节偏移
+long long editorRowOffset(int at)
+{
+    rowPath path;
+    int idx, i, j;
+    long long off = 0;
+    rowLeaf *leaf = rowTreeFind(at, &path, &idx);
+    for (i = 0; i < path.depth; i++)
+        for (j = 0; j < path.idx[i]; j++)
+            off += path.node[i]->child[j]->bytes;
+    for (j = 0; j < idx; j++)
+        off += leaf->size[j] + 1;
+    return off;
 }
 
-//基础版的接受屏幕输入函数
-char *editorPrompt0(char *prompt)
+//字节偏移off所在的行号，*col返回在行内的偏移
+int editorRowFromOffset(long long off, int *col)
 {
-    size_t bufsize = 128;
-    char *buf = malloc(bufsize);
-    size_t buflen = 0;
-    buf[0] = '\0';
-    while (1)
+    if (E.rowroot == NULL || off >= E.rowroot->bytes)
     {
-        editorSetStatusMessage(prompt, buf);
-        editorRefreshScreen();
-        int c = editorReadKey();
-        if (c == '\r')
+        *col = 0;
+        return E.numrows;
+    }
+    if (off < 0)
+        off = 0;
+    rowNode *n = E.rowroot;
+    int at = 0;
+    while (!n->leaf)
+    {
+        rowInner *in = (rowInner *)n;
+        int i;
+        for (i = 0; i < n->n - 1 && off >= in->child[i]->bytes; i++)
         {
-            if (buflen != 0)
-            {
-                editorSetStatusMessage("");
-                return buf;
-            }
+            off -= in->child[i]->bytes;
+            at += in->child[i]->rows;
         }
-        else if (!iscntrl(c) && c < 128)
+        n = in->child[i];
+    }
+    rowLeaf *leaf = (rowLeaf *)n;
+    int i;
+    for (i = 0; i < n->n - 1 && off >= leaf->size[i] + 1; i++)
+        off -= leaf->size[i] + 1;
+    //落在换行符上时视为行尾
+    *col = off > leaf->size[i] ? leaf->size[i] : off;
+    return at + i;
+}
+
+/*** render cache ***/
+/*行的实际渲染（展开制表符后的文本）只为绘制到的行生成，保存在有上限的LRU缓存中，
+以行号为键。没有制表符的行渲染与chars相同，不分配缓冲区，也不占用缓存项：
+叶子中记下这一行是plain，之后直接返回chars。
+缓存项中还有行内制表符的索引（位置和展开后的渲染位置），修改行时随之平移，
+cx与rx的换算在索引中二分查找，不必从行首逐个字符计算*/
+
+//统计s中的制表符个数。SSE2一次比较16个字节，按字节累加比较结果，最多255次后用sad求和
+int renderCountTabs(const char *s, int n)
+{
+    int count = 0;
+    int j = 0;
+#ifdef __SSE2__
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc = zero, sum = zero;
+    int k = 0;
+    for (; j + 16 <= n; j += 16)
+    {
+        acc = _mm_sub_epi8(acc, _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(s + j)), tab));
+        if (++k == 255)
         {
-            if (buflen == bufsize - 1)
-            {
-                bufsize *= 2;
-                buf = realloc(buf, bufsize);
-            }
-            buf[buflen++] = c;
-            buf[buflen] = '\0';
+            sum = _mm_add_epi64(sum, _mm_sad_epu8(acc, zero));
+            acc = zero;
+            k = 0;
         }
     }
+    sum = _mm_add_epi64(sum, _mm_sad_epu8(acc, zero));
+    count = _mm_cvtsi128_si32(sum) + _mm_cvtsi128_si32(_mm_srli_si128(sum, 8));
+#endif
+    for (; j < n; j++)
+        if (s[j] == '\t')
+            count++;
+    return count;
 }
 
-//替换函数
-void editorReplace()
+//把s中制表符的位置（加上base）依次写入t，只填cx
+void renderFindTabs(tabStop *t, const char *s, int n, int base)
 {
-    char *query = editorPrompt0("Search: %s (ESC to cancel)");
-    if (query == NULL)
-        return;
-    //查找
-    int i;
-    for (i = 0; i < E.numrows; i++)
+    int j = 0;
+#ifdef __SSE2__
+    const __m128i tab = _mm_set1_epi8('\t');
+    for (; j + 16 <= n; j += 16)
     {
-        erow *row = &E.row[i];
-        char *match = strstr(row->render, query);
-        if (match)
-        {
-            E.cy = i;
-            E.cx = editorRowRxToCx(row, match - row->render);
-            E.rowoff = E.numrows;
-            char *replace = editorPrompt0("Replace: %s (ESC to cancel)");
-            //使指向原子字符串的指针指向替换后的字符串
-            row->chars = replaceWord(row->render, query, replace);
-            row->render = replaceWord(row->render, query, replace);
-            free(replace);
-            break;
+        unsigned mask = _mm_movemask_epi8(
+            _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)(s + j)), tab));
+        while (mask)
+        {
+            (t++)->cx = base + j + __builtin_ctz(mask);
+            mask &= mask - 1;
         }
     }
-
-    free(query);
+#endif
+    const char *q;
+    while (j < n && (q = memchr(s + j, '\t', n - j)) != NULL)
+    {
+        j = q - s;
+        (t++)->cx = base + j++;
+    }
 }
 
-/*** append buffer ***/
-//可附加缓冲区
-struct abuf
+//确保缓存项的制表符索引能容纳n项，容量按倍数增长
+void renderReserveTabs(renderEntry *e, int n)
 {
-    char *b; //追加的内容
-    int len; //追加的长度
-};
+    if (n <= e->tabcap)
+        return;
+    int cap = e->tabcap ? e->tabcap : 4;
+    while (cap < n)
+        cap *= 2;
+    if (e->tabcap == 0)
+        e->tabs = slabAlloc(sizeof(tabStop) * cap);
+    else
+        e->tabs = slabRealloc(e->tabs, sizeof(tabStop) * e->tabcap, sizeof(tabStop) * cap);
+    e->tabcap = cap;
+}
 
-#define ABUF_INIT \
-    {             \
-        NULL, 0   \
+//从第k个制表符起重新计算展开后的位置：制表符补齐到KILO_TAB_STOP的倍数
+void renderTabsFix(renderEntry *e, int k)
+{
+    tabStop *t = e->tabs;
+    int cx = k ? t[k - 1].cx + 1 : 0;
+    int rx = k ? t[k - 1].rx : 0;
+    for (; k < e->ntabs; k++)
+    {
+        rx += t[k].cx - cx;
+        rx += KILO_TAB_STOP - rx % KILO_TAB_STOP;
+        t[k].rx = rx;
+        cx = t[k].cx + 1;
     }
-//对可追加缓冲区进行追加
-void abAppend(struct abuf *ab, const char *s, int len)
-{ //新建一个指向长度变更后的字符串指针，包含原内容
-    char *new = realloc(ab->b, ab->len + len);
+}
 
-    if (new == NULL)
-        return;
-    //从追加位置开始拷贝
-    memcpy(&new[ab->len], s, len);
-    //替换
-    ab->b = new;
-    ab->len += len;
+//索引中位置在cx之前的制表符个数
+int renderTabsBefore(renderEntry *e, int cx)
+{
+    int lo = 0, hi = e->ntabs;
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (e->tabs[mid].cx < cx)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
 }
 
-void abFree(struct abuf *ab)
+//按制表符索引生成行的实际渲染：制表符之间的文本整段复制，制表符展开为空格
+void editorUpdateRow(erow *row, renderEntry *e)
 {
-    free(ab->b);
+    tabStop *t = e->tabs;
+    int n = e->ntabs;
+    int rsize = t[n - 1].rx + row->size - t[n - 1].cx - 1;
+    char *render = slabAlloc(rsize + 1);
+    int cx = 0, rx = 0;
+    int k;
+    for (k = 0; k < n; k++)
+    {
+        memcpy(&render[rx], &row->chars[cx], t[k].cx - cx);
+        rx += t[k].cx - cx;
+        memset(&render[rx], ' ', t[k].rx - rx);
+        rx = t[k].rx;
+        cx = t[k].cx + 1;
+    }
+    memcpy(&render[rx], &row->chars[cx], row->size - cx);
+    render[rsize] = '\0';
+    e->render = render;
+    e->rsize = rsize;
 }
 
-/*** output ***/
-/*我们的策略是检查光标是否移到了可见窗口之外，如果是，调整E.rowoff，使光标正好位于可见窗口内。*/
+//把缓存项从LRU链表中摘下
+void renderUnlink(int i)
+{
+    renderEntry *e = &E.rcache.e[i];
+    if (e->prev != -1)
+        E.rcache.e[e->prev].next = e->next;
+    else
+        E.rcache.head = e->next;
+    if (e->next != -1)
+        E.rcache.e[e->next].prev = e->prev;
+    else
+        E.rcache.tail = e->prev;
+}
 
-void editorScroll()
+//把缓存项放到LRU链表的头部（最近使用）或尾部（最先淘汰）
+void renderLink(int i, int front)
 {
-    E.rx = 0;
-    if (E.cy < E.numrows)
+    renderEntry *e = &E.rcache.e[i];
+    if (front)
     {
-        E.rx = editorRowCxToRx(&E.row[E.cy], E.cx);
+        e->prev = -1;
+        e->next = E.rcache.head;
+        if (E.rcache.head != -1)
+            E.rcache.e[E.rcache.head].prev = i;
+        E.rcache.head = i;
+        if (E.rcache.tail == -1)
+            E.rcache.tail = i;
     }
-    //当光标小于偏移量时，E.rowoff = E.cy，显示时的坐标为 E.cy-E.rowoff=1
-
-    if (E.cy < E.rowoff)
+    else
     {
-        E.rowoff = E.cy;
+        e->next = -1;
+        e->prev = E.rcache.tail;
+        if (E.rcache.tail != -1)
+            E.rcache.e[E.rcache.tail].next = i;
+        E.rcache.tail = i;
+        if (E.rcache.head == -1)
+            E.rcache.head = i;
     }
-    /*当光标超过偏移量+显示范围，就让E.rowoff = E.cy - E.screenrows + 1
-  显示时坐标为E.y-E.rowoff=E.screenrows
-  */
-    if (E.cy >= E.rowoff + E.screenrows)
+}
+
+//按行号重建哈希表
+void renderRehash()
+{
+    int i;
+    for (i = 0; i < RENDER_HASH_SIZE; i++)
+        E.rcache.hash[i] = -1;
+    for (i = 0; i < E.rcache.cap; i++)
     {
-        E.rowoff = E.cy - E.screenrows + 1;
+        renderEntry *e = &E.rcache.e[i];
+        if (e->row < 0)
+            continue;
+        e->hnext = E.rcache.hash[e->row & (RENDER_HASH_SIZE - 1)];
+        E.rcache.hash[e->row & (RENDER_HASH_SIZE - 1)] = i;
     }
-    if (E.rx < E.coloff)
+}
+
+//释放缓存项的渲染和制表符索引，移到LRU链表尾部等待复用（不修改哈希表）
+void renderRelease(int i)
+{
+    renderEntry *e = &E.rcache.e[i];
+    slabFree(e->render, e->rsize + 1);
+    slabFree(e->tabs, sizeof(tabStop) * e->tabcap);
+    e->render = NULL;
+    e->tabs = NULL;
+    e->ntabs = e->tabcap = 0;
+    e->row = -1;
+    renderUnlink(i);
+    renderLink(i, 0);
+}
+
+//从哈希表中摘下并释放缓存项
+void renderDrop(int i)
+{
+    renderEntry *e = &E.rcache.e[i];
+    int *p = &E.rcache.hash[e->row & (RENDER_HASH_SIZE - 1)];
+    while (*p != i)
+        p = &E.rcache.e[*p].hnext;
+    *p = e->hnext;
+    renderRelease(i);
+}
+
+//查找第at行的缓存项，没有时返回-1
+int renderLookup(int at)
+{
+    if (E.rcache.cap == 0)
+        return -1;
+    int i = E.rcache.hash[at & (RENDER_HASH_SIZE - 1)];
+    while (i != -1 && E.rcache.e[i].row != at)
+        i = E.rcache.e[i].hnext;
+    return i;
+}
+
+//分配能容纳cap行渲染的缓存
+void editorRenderInit(int cap)
+{
+    int i;
+    E.rcache.cap = cap;
+    E.rcache.e = malloc(sizeof(renderEntry) * cap);
+    E.rcache.head = E.rcache.tail = -1;
+    for (i = 0; i < cap; i++)
     {
-        E.coloff = E.rx;
+        E.rcache.e[i].row = -1;
+        E.rcache.e[i].render = NULL;
+        E.rcache.e[i].tabs = NULL;
+        E.rcache.e[i].ntabs = E.rcache.e[i].tabcap = 0;
+        renderLink(i, 0);
     }
-    if (E.rx >= E.coloff + E.screencols)
+    renderRehash();
+}
+
+/*取得第at行的缓存项，*row为行的内容。没有制表符的行记为plain并返回-1。
+未命中时复用最久未用的一项，只建立制表符索引，渲染到绘制时才生成*/
+int editorRowTabs(int at, erow *row)
+{
+    int idx;
+    rowLeaf *leaf = editorRowLeaf(at, &idx);
+    *row = rowGet(leaf, idx);
+    if (leaf->plain >> idx & 1)
+        return -1;
+    int i = renderLookup(at);
+    if (i == -1)
     {
-        E.coloff = E.rx - E.screencols + 1;
+        int n = renderCountTabs(row->chars, row->size);
+        if (n == 0)
+        {
+            leaf->plain |= 1ULL << idx;
+            return -1;
+        }
+        //未命中：复用最久未用的一项
+        i = E.rcache.tail;
+        if (E.rcache.e[i].row >= 0)
+            renderDrop(i);
+        renderEntry *e = &E.rcache.e[i];
+        renderReserveTabs(e, n);
+        renderFindTabs(e->tabs, row->chars, row->size, 0);
+        e->ntabs = n;
+        renderTabsFix(e, 0);
+        e->row = at;
+        e->hnext = E.rcache.hash[at & (RENDER_HASH_SIZE - 1)];
+        E.rcache.hash[at & (RENDER_HASH_SIZE - 1)] = i;
     }
+    renderUnlink(i);
+    renderLink(i, 1);
+    return i;
 }
-//按行绘制
-void editorDrawRows(struct abuf *ab)
+
+//返回第at行的实际渲染，*rsize为渲染长度。没有制表符的行直接返回chars
+char *editorRowRender(int at, int *rsize)
 {
-    int y;
-    //显示小于窗口的行数的内容
-    for (y = 0; y < E.screenrows; y++)
-    { /*相当于从E.row[rowoff]的位置开始显示
-    */
-        int filerow = y + E.rowoff;
-        //对于大于文件行数的行，行首打印'~'
-        if (filerow >= E.numrows)
+    erow row;
+    int i = editorRowTabs(at, &row);
+    if (i == -1)
+    {
+        *rsize = row.size;
+        return row.chars;
+    }
+    renderEntry *e = &E.rcache.e[i];
+    if (e->render == NULL)
+        editorUpdateRow(&row, e);
+    *rsize = e->rsize;
+    return e->render;
+}
+
+/*第at行在col处插入了s中的len个字节（s为NULL时表示从col起删除了len个字节）：
+丢弃旧的渲染，平移制表符索引，只重新计算修改处之后的展开位置*/
+void editorRenderEdit(int at, int col, const char *s, int len)
+{
+    int i = renderLookup(at);
+    if (i == -1)
+        return;
+    renderEntry *e = &E.rcache.e[i];
+    slabFree(e->render, e->rsize + 1);
+    e->render = NULL;
+    int k = renderTabsBefore(e, col);
+    int j;
+    if (s)
+    {
+        int n = renderCountTabs(s, len);
+        renderReserveTabs(e, e->ntabs + n);
+        memmove(&e->tabs[k + n], &e->tabs[k], sizeof(tabStop) * (e->ntabs - k));
+        renderFindTabs(&e->tabs[k], s, len, col);
+        e->ntabs += n;
+        for (j = k + n; j < e->ntabs; j++)
+            e->tabs[j].cx += len;
+    }
+    else
+    {
+        int end = renderTabsBefore(e, col + len);
+        memmove(&e->tabs[k], &e->tabs[end], sizeof(tabStop) * (e->ntabs - end));
+        e->ntabs -= end - k;
+        for (j = k; j < e->ntabs; j++)
+            e->tabs[j].cx -= len;
+    }
+    if (e->ntabs == 0) //制表符都删掉了，下次绘制时记为plain
+        renderDrop(i);
+    else
+        renderTabsFix(e, k);
+}
+
+/*在第at行处插入(delta>0)或删除(delta<0)行后调整缓存中的行号，
+被删除行的渲染丢弃。只需遍历缓存，与文件行数无关*/
+void editorRenderShift(int at, int delta)
+{
+    int i;
+    for (i = 0; i < E.rcache.cap; i++)
+    {
+        renderEntry *e = &E.rcache.e[i];
+        if (e->row < at)
+            continue;
+        if (delta < 0 && e->row < at - delta)
+            renderRelease(i);
+        else
+            e->row += delta;
+    }
+    renderRehash();
+}
+
+/*** row operations ***/
+//将第at行的cx转换为rx：二分查找cx之前的最后一个制表符，从它展开后的位置数起
+int editorRowCxToRx(int at, int cx)
+{
+    erow row;
+    int i = editorRowTabs(at, &row);
+    if (i == -1)
+        return cx;
+    renderEntry *e = &E.rcache.e[i];
+    int k = renderTabsBefore(e, cx);
+    if (k == 0)
+        return cx;
+    return e->tabs[k - 1].rx + cx - e->tabs[k - 1].cx - 1;
+}
+
+//将第at行的rx转换为cx：rx落在制表符展开的空白中时返回制表符的位置
+int editorRowRxToCx(int at, int rx)
+{
+    erow row;
+    int i = editorRowTabs(at, &row);
+    int cx = rx;
+    if (i != -1)
+    { //二分查找展开后的位置不超过rx的最后一个制表符
+        renderEntry *e = &E.rcache.e[i];
+        int lo = 0, hi = e->ntabs;
+        while (lo < hi)
         {
-            //在不加载文件的条件下，打印欢迎信息，首先使欢迎信息行定位
+            int mid = (lo + hi) / 2;
+            if (e->tabs[mid].rx <= rx)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        if (lo > 0)
+            cx = e->tabs[lo - 1].cx + 1 + rx - e->tabs[lo - 1].rx;
+        if (lo < e->ntabs && cx > e->tabs[lo].cx)
+            cx = e->tabs[lo].cx;
+    }
+    return cx < row.size ? cx : row.size;
+}
 
-            if (E.numrows == 0 && y == E.screenrows / 3)
+//第at行内容已修改，更新字节数。渲染和制表符索引由调用者用editorRenderEdit更新
+void editorRowChanged(int at, int delta)
+{
+    if (delta)
+    {
+        rowPath path;
+        int idx;
+        rowLeaf *leaf = rowTreeFind(at, &path, &idx);
+        rowPathAdd(&path, leaf, 0, delta);
+    }
+    E.dirty++;
+}
+
+//插入一行，行内容直接引用s（原始文本缓冲区），在修改前不复制
+void editorInsertRowRef(int at, char *s, size_t len)
+{
+    erow row = {len, 0, s};
+    editorInsertRows(at, &row, 1);
+}
+
+//插入行
+void editorInsertRow(int at, char *s, size_t len)
+{ //检测坐标在文本内
+    if (at < 0 || at > E.numrows)
+        return;
+    //重建第at行
+    erow row = {len, len ? slabRound(len) : 0, len ? slabAlloc(slabRound(len)) : NULL};
+    if (len)
+        memcpy(row.chars, s, len);
+    editorInsertRows(at, &row, 1);
+    E.dirty++;
+}
+
+//释放叶子中第i行的缓冲区
+void editorFreeRow(rowLeaf *leaf, int i)
+{
+    erow row = rowGet(leaf, i);
+    if (row.cap > ROW_INLINE)
+        slabFree(row.chars, row.cap);
+    if (leaf->heap)
+        leaf->heap[i] = NULL;
+}
+
+//删除一行
+void editorDelRow(int at)
+{
+    editorDelRows(at, 1);
+}
+
+//关闭缓冲区：丢弃所有渲染，释放行索引和行文本。slab中的空间整块释放，不必逐行free
+void editorFreeRows()
+{
+    int i;
+    for (i = 0; i < E.rcache.cap; i++)
+        if (E.rcache.e[i].row >= 0)
+            renderRelease(i);
+    renderRehash();
+    if (E.rowroot)
+        rowTreeFree(E.rowroot);
+    E.rowroot = NULL;
+    E.rowleaf = NULL;
+    E.numrows = 0;
+    slabReset();
+}
+
+/*确保第at行的内容归自己所有且容量不小于need，返回可以修改的内容。
+不超过ROW_INLINE字节时内联存放在叶子中，否则放在slab中，容量按倍数增长*/
+char *editorRowReserve(int at, int need)
+{
+    int i;
+    rowLeaf *leaf = editorRowLeaf(at, &i);
+    erow row = rowGet(leaf, i);
+    if (need <= ROW_INLINE && row.cap <= ROW_INLINE)
+    {
+        if (row.cap == 0)
+        { //第一次修改引用原始文本的短行，复制到叶子中
+            memcpy(leaf->text[i].s, row.chars, row.size);
+            leaf->owned |= 1ULL << i;
+        }
+        return leaf->text[i].s;
+    }
+    if (row.cap >= need)
+        return row.chars;
+    int cap = rowCap(need);
+    char *chars;
+    if (row.cap > ROW_INLINE)
+        chars = slabRealloc(row.chars, row.cap, cap);
+    else
+    { //第一次修改引用原始文本的行，或内联的行变长，复制一份
+        chars = slabAlloc(cap);
+        if (row.size)
+            memcpy(chars, row.chars, row.size);
+    }
+    rowAdopt(leaf, i, chars, cap);
+    return chars;
+}
+
+/*第i行从oldsize变短后：可以内联时移回叶子中，释放缓冲区；
+slab中的行换到与行长相符的大小类*/
+void editorRowShrink(rowLeaf *leaf, int i, int oldsize)
+{
+    int large = leaf->heap && leaf->heap[i];
+    if (!(leaf->owned >> i & 1) || (!large && oldsize <= ROW_INLINE))
+        return;
+    int size = leaf->size[i];
+    int cap = large ? leaf->text[i].cap : rowCap(oldsize);
+    char *chars = large ? leaf->heap[i] : slabPtr(leaf->text[i].h);
+    if (size <= ROW_INLINE)
+    {
+        memcpy(leaf->text[i].s, chars, size);
+        slabFree(chars, cap);
+        if (large)
+            leaf->heap[i] = NULL;
+    }
+    else if (!large && rowCap(size) < cap)
+        rowAdopt(leaf, i, slabRealloc(chars, cap, rowCap(size)), rowCap(size));
+}
+
+//在第at行的col处插入字符串
+void editorRowInsertString(int at, int col, const char *s, size_t len)
+{
+    int i;
+    rowLeaf *leaf = editorRowLeaf(at, &i);
+    int size = leaf->size[i];
+    if (col < 0 || col > size)
+        col = size;
+    char *chars = editorRowReserve(at, size + len);
+    //将col之后的内容后移len位，空出插入位置
+    memmove(&chars[col + len], &chars[col], size - col);
+    memcpy(&chars[col], s, len);
+    leaf->size[i] += len;
+    if (memchr(s, '\t', len))
+        leaf->plain &= ~(1ULL << i);
+    editorRenderEdit(at, col, s, len);
+    editorRowChanged(at, len);
+}
+
+//在行中插入字符
+void editorRowInsertChar(int at, int col, int c)
+{
+    char ch = c;
+    editorRowInsertString(at, col, &ch, 1);
+}
+
+//在行尾添加字符字符串
+void editorRowAppendString(int at, char *s, size_t len)
+{
+    editorRowInsertString(at, editorRow(at).size, s, len);
+}
+
+//在第at行中删除从col开始的len个字符
+void editorRowDelString(int at, int col, int len)
+{
+    int i;
+    rowLeaf *leaf = editorRowLeaf(at, &i);
+    erow row = rowGet(leaf, i);
+    if (col < 0 || col >= row.size || len <= 0)
+        return;
+    if (len > row.size - col)
+        len = row.size - col;
+    if (row.cap == 0 && col == 0)
+    { //引用原始文本的行，删除行首只需移动起点
+        leaf->text[i].off += len;
+    }
+    else if (row.cap > 0 || col + len < row.size)
+    {
+        char *chars = editorRowReserve(at, row.size);
+        //使用memmove()来用后面的字符覆盖被删除的字符
+        memmove(&chars[col], &chars[col + len], row.size - col - len);
+    }
+    leaf->size[i] -= len;
+    editorRowShrink(leaf, i, row.size);
+    editorRenderEdit(at, col, NULL, len);
+    editorRowChanged(at, -len);
+}
+
+//把第at行从col开始的oldlen个字符换成s，行的缓冲区最多重新分配一次
+void editorRowReplaceString(int at, int col, int oldlen, const char *s, int len)
+{
+    int i;
+    rowLeaf *leaf = editorRowLeaf(at, &i);
+    int size = leaf->size[i];
+    //变短时先在原来的空间中移动，再由editorRowShrink换到合适的大小
+    char *chars = editorRowReserve(at, len > oldlen ? size - oldlen + len : size);
+    memmove(&chars[col + len], &chars[col + oldlen], size - col - oldlen);
+    memcpy(&chars[col], s, len);
+    leaf->size[i] += len - oldlen;
+    if (memchr(s, '\t', len))
+        leaf->plain &= ~(1ULL << i);
+    editorRowShrink(leaf, i, size);
+    editorRenderEdit(at, col, NULL, oldlen);
+    editorRenderEdit(at, col, s, len);
+    editorRowChanged(at, len - oldlen);
+}
+
+//在行中删除字符
+void editorRowDelChar(int at, int col)
+{
+    editorRowDelString(at, col, 1);
+}
+
+/*** editor operations ***/
+/*在(at,col)处插入文本，文本中的'\n'会把当前行拆成两行。
+所有修改文本的操作都经过这里和editorDeleteText，以便统一记录撤销信息*/
+void editorInsertText(int at, int col, const char *s, int len)
+{
+    if (at < 0 || at > E.numrows || len <= 0)
+        return;
+    if (at == E.numrows && at > 0)
+    { //在文件末尾的空行输入，相当于先在最后一行行尾插入换行
+        editorUndoBeginGroup();
+        editorInsertText(at - 1, editorRow(at - 1).size, "\n", 1);
+        editorInsertText(at, 0, s, len);
+        editorUndoEndGroup();
+        E.undo.coalesce = (len == 1 && s[0] != '\n');
+        return;
+    }
+    //查找线程可能正在读取这些行
+    editorSearchEditBegin();
+    editorUndoPush(UNDO_INSERT, at, col, s, len);
+    editorJournalAppend(JOURNAL_INSERT, at, col, s, len);
+    int first = at;
+    int oldrows = 1;
+    if (at == E.numrows)
+    {
+        editorInsertRow(E.numrows, "", 0);
+        oldrows = 0;
+    }
+
+    erow row = editorRow(at);
+    if (col > row.size)
+        col = row.size;
+    const char *nl = memchr(s, '\n', len);
+    if (nl == NULL)
+    {
+        editorRowInsertString(at, col, s, len);
+    }
+    else
+    { /*拆行：一遍把文本切成行，第一段接到col处，中间各段各成一行，最后一段与col之后的
+        内容成为最后一行，新行一次插入行索引。大段粘贴的代价与文本长度成正比*/
+        int count = 0, cap = 16;
+        erow *rows = malloc(sizeof(erow) * cap);
+        const char *p = nl + 1, *end = s + len;
+        const char *tail = &row.chars[col];
+        int tailsize = row.size - col;
+        while (1)
+        {
+            const char *q = memchr(p, '\n', end - p);
+            int seg = (q ? q : end) - p;
+            if (count == cap)
             {
-                char welcome[80];
-                int welcomelen = snprintf(welcome, sizeof(welcome),
-                                          "miword -- version %s", KILO_VERSION);
-                //窗口不够宽，截断欢迎信息
-                if (welcomelen > E.screencols)
-                    welcomelen = E.screencols;
-                //使欢迎信息列居中
-                int padding = (E.screencols - welcomelen) / 2;
-                if (padding)
-                {
-                    abAppend(ab, "~", 1);
-                    padding--;
-                }
-                while (padding--)
-                    abAppend(ab, " ", 1);
-                abAppend(ab, welcome, welcomelen);
+                cap *= 2;
+                rows = realloc(rows, sizeof(erow) * cap);
+            }
+            erow *r = &rows[count++];
+            if (q)
+            { //中间的整行
+                r->size = seg;
+                r->cap = seg ? slabRound(seg) : 0;
+                r->chars = seg ? slabAlloc(r->cap) : NULL;
+                if (seg)
+                    memcpy(r->chars, p, seg);
+                p = q + 1;
+                continue;
+            }
+            if (seg == 0 && row.cap == 0)
+            { //引用原始文本的行，拆出的新行继续引用原始文本
+                r->size = tailsize;
+                r->cap = 0;
+                r->chars = (char *)tail;
             }
             else
-            { //打印文件,从列偏移的位置开始打印每行
-                abAppend(ab, "~", 1);
+            {
+                r->size = seg + tailsize;
+                r->cap = r->size ? slabRound(r->size) : 0;
+                r->chars = r->size ? slabAlloc(r->cap) : NULL;
+                if (seg)
+                    memcpy(r->chars, p, seg);
+                if (tailsize)
+                    memcpy(r->chars + seg, tail, tailsize);
             }
+            break;
         }
-        else
-        {
-            int len = E.row[filerow].rsize - E.coloff;
-            if (len < 0)
-                len = 0;
-            //截断超过窗口的部分
-            if (len > E.screencols)
-                len = E.screencols;
-            abAppend(ab, &E.row[filerow].render[E.coloff], len);
-        }
-        //清除光标右端至结尾
-        abAppend(ab, "\x1b[K", 3);
-        //换行，光标置于行首
-        abAppend(ab, "\r\n", 2);
+        editorRowDelString(at, col, tailsize);
+        editorRowInsertString(at, col, s, nl - s);
+        editorInsertRows(at + 1, rows, count);
+        free(rows);
+        E.dirty++;
+        at += count;
     }
+    editorSearchEditEnd(first, oldrows, at - first + 1);
+    editorSaveTouch(first, at);
 }
-//绘制状态栏
-void editorDrawStatusBar(struct abuf *ab)
+
+/*删除从(at,col)开始的len个字符，行尾的换行计作一个字符（与下一行合并）。
+返回被删除的文本，由调用者释放；*dellen为实际删除的长度*/
+char *editorDeleteText(int at, int col, int len, int *dellen)
 {
-    //修改颜色
-    abAppend(ab, "\x1b[7m", 4);
-    char status[80], rstatus[80];
-    //打印路径（新建文件路径为[No Name]）与文件行数
-    //如果文件已被修改，则在文件名后显示(已修改)。
-    int len = snprintf(status, sizeof(status), "%.20s - %d lines %s",
-                       E.filename ? E.filename : "[No Name]", E.numrows,
-                       E.dirty ? "(modified)" : "");
-    //打印光标所在行数与文件总行数
-    int rlen = snprintf(rstatus, sizeof(rstatus), "%d/%d",
-                        E.cy + 1, E.numrows);
-    //窗口不够大，信息截断
-    if (len > E.screencols)
-        len = E.screencols;
-    abAppend(ab, status, len);
-    while (len < E.screencols)
-    { //当第2条信息的尾部与窗口对齐
-        if (E.screencols - len == rlen)
+    editorSearchEditBegin();
+    char *out = malloc(len + 1);
+    int n = 0;
+    int joined = 0;
+    while (n < len && at < E.numrows)
+    {
+        erow row = editorRow(at);
+        if (col < row.size)
         {
-            abAppend(ab, rstatus, rlen);
-            break;
+            int take = row.size - col;
+            if (take > len - n)
+                take = len - n;
+            memcpy(&out[n], &row.chars[col], take);
+            editorRowDelString(at, col, take);
+            n += take;
         }
         else
-        { //在两条信息间打印空格
-            abAppend(ab, " ", 1);
-            len++;
+        { //在行尾删除：把下一行接到本行末尾
+            editorLoadRows(at + 2);
+            if (at + 1 >= E.numrows)
+                break;
+            erow next = editorRow(at + 1);
+            editorRowAppendString(at, next.chars, next.size);
+            editorDelRow(at + 1);
+            out[n++] = '\n';
+            joined++;
         }
     }
-    //将颜色调回
-    abAppend(ab, "\x1b[m", 3);
-    abAppend(ab, "\r\n", 2);
+    out[n] = '\0';
+    if (n > 0)
+    {
+        editorSearchEditEnd(at, joined + 1, 1);
+        editorSaveTouch(at, at);
+        editorUndoPush(UNDO_DELETE, at, col, out, n);
+        editorJournalAppend(JOURNAL_DELETE, at, col, out, n);
+    }
+    if (dellen)
+        *dellen = n;
+    return out;
 }
 
-//绘制状态信息
-void editorDrawMessageBar(struct abuf *ab)
+/*把第at行从col开始的oldlen个字符换成s（都不含换行），作为一条撤销记录和一条日志记录，
+只记下换掉的这一段*/
+void editorReplaceText(int at, int col, int oldlen, const char *s, int len)
 {
-    abAppend(ab, "\x1b[K", 3);
-    int msglen = strlen(E.statusmsg);
-    if (msglen > E.screencols)
-        msglen = E.screencols;
-    if (msglen && time(NULL) - E.statusmsg_time < 5)
-        abAppend(ab, E.statusmsg, msglen);
+    if (at < 0 || at >= E.numrows || (oldlen == 0 && len == 0))
+        return;
+    erow row = editorRow(at);
+    if (col < 0 || oldlen < 0 || col + oldlen > row.size)
+        return;
+    editorSearchEditBegin();
+    editorUndoPushReplace(at, col, &row.chars[col], oldlen, s, len);
+    editorJournalAppendReplace(at, col, oldlen, s, len);
+    editorRowReplaceString(at, col, oldlen, s, len);
+    editorSearchEditEnd(at, 1, 1);
+    editorSaveTouch(at, at);
 }
 
-//刷新屏幕
-void editorRefreshScreen()
+//接受一个字符并使用editorInsertText()将该字符插入到光标所在的位置。
+void editorInsertChar(int c)
 {
-    editorScroll();
+    char ch = c;
+    editorInsertText(E.cy, E.cx, &ch, 1);
+    E.cx++;
+}
+//在光标处插入粘贴的一整段文本：一次拆分成行插入，作为一步撤销，光标移到粘贴内容之后
+void editorInsertPaste(const char *s, int len)
+{
+    if (len == 0)
+        return;
+    editorUndoBeginGroup();
+    editorInsertText(E.cy, E.cx, s, len);
+    editorUndoEndGroup();
+    const char *p = s, *end = s + len, *nl;
+    while ((nl = memchr(p, '\n', end - p)) != NULL)
+    {
+        E.cy++;
+        E.cx = 0;
+        p = nl + 1;
+    }
+    E.cx += end - p;
+}
+//处理新建行
+void editorInsertNewline()
+{
+    //在文件末尾的空行回车：只在最后一行行尾加换行，光标仍在文件末尾的空行
+    if (E.cy == E.numrows && E.numrows > 0)
+        editorInsertText(E.cy - 1, editorRow(E.cy - 1).size, "\n", 1);
+    else
+        editorInsertText(E.cy, E.cx, "\n", 1);
+    E.cy++;
+    E.cx = 0;
+}
+//确定删除字符的位置
+void editorDelChar()
+{
+    if (E.cy == E.numrows)
+        return;
+    //游标位于开头
+    if (E.cx == 0 && E.cy == 0)
+        return;
+    if (E.cx > 0)
+    {
+        free(editorDeleteText(E.cy, E.cx - 1, 1, NULL));
+        E.cx--;
+    }
+    //在行头删除：删除上一行行尾的换行
+    else
+    {
+        int prevsize = editorRow(E.cy - 1).size;
+        free(editorDeleteText(E.cy - 1, prevsize, 1, NULL));
+        E.cy--;
+        E.cx = prevsize;
+    }
+}
 
-    struct abuf ab = ABUF_INIT;
-    //刷新屏幕时隐藏光标
-    abAppend(&ab, "\x1b[?25l", 6);
-    //重置光标位置
-    abAppend(&ab, "\x1b[H", 3);
+/*** undo & redo ***/
+/*撤销日志只保存每次编辑的逆操作所需的信息（插入/删除的文本片段及光标），
+而不是整个缓冲区的快照，因此每次按键的开销只与编辑大小有关。
+[0,current)为已生效的记录，[current,len)为可以重做的记录。*/
 
-    editorDrawRows(&ab);
-    //绘制状态栏栏
-    editorDrawStatusBar(&ab);
-    editorDrawMessageBar(&ab);
+//开启一个撤销组，组内的所有编辑作为一步撤销
+void editorUndoBeginGroup()
+{
+    if (E.undo.depth++ == 0)
+        E.undo.group++;
+}
 
-    char buf[32];
-    //终端使用1引索，C语言使用0引索，注意行坐标采用的是rx
-    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1,
-             (E.rx - E.coloff) + 1);
-    abAppend(&ab, buf, strlen(buf));
-    //显示光标
-    abAppend(&ab, "\x1b[?25h", 6);
+void editorUndoEndGroup()
+{
+    if (E.undo.depth > 0)
+        E.undo.depth--;
+    //组结束后不再与后续按键合并
+    E.undo.coalesce = 0;
+}
 
-    //我们将缓冲区的内容写入标准输出，并释放abuf使用的内存。
-    write(STDOUT_FILENO, ab.b, ab.len);
-    abFree(&ab);
+void editorUndoFreeRecord(undoRecord *r)
+{
+    E.undo.mem -= sizeof(undoRecord) + r->cap;
+    free(r->text);
 }
-//打印信息
-void editorSetStatusMessage(const char *fmt, ...)
+
+//清空撤销日志
+void editorUndoReset()
 {
-    va_list ap;
-    va_start(ap, fmt);
-    vsnprintf(E.statusmsg, sizeof(E.statusmsg), fmt, ap);
-    va_end(ap);
-    E.statusmsg_time = time(NULL);
+    while (E.undo.len > 0)
+        editorUndoFreeRecord(&E.undo.rec[--E.undo.len]);
+    E.undo.current = 0;
+    E.undo.coalesce = 0;
 }
 
-/*** input ***/
+//超出内存上限时，从最早的一组开始丢弃
+void editorUndoTrim()
+{
+    int drop = 0;
+    while (E.undo.mem > E.undo.limit && drop < E.undo.current - 1)
+    {
+        int group = E.undo.rec[drop].group;
+        //正在记录的组不能只丢弃一部分
+        if (E.undo.depth > 0 && group == E.undo.group)
+            break;
+        while (drop < E.undo.current - 1 && E.undo.rec[drop].group == group)
+            editorUndoFreeRecord(&E.undo.rec[drop++]);
+    }
+    if (drop == 0)
+        return;
+    memmove(E.undo.rec, &E.undo.rec[drop], sizeof(undoRecord) * (E.undo.len - drop));
+    E.undo.len -= drop;
+    E.undo.current -= drop;
+}
+
+//尝试把单字符编辑并入上一条记录
+int editorUndoCoalesce(int type, int at, int col, const char *s, int len)
+{
+    if (!E.undo.coalesce || E.undo.depth > 0 || len != 1 || s[0] == '\n')
+        return 0;
+    if (E.undo.current == 0 || E.undo.current != E.undo.len)
+        return 0;
+    undoRecord *r = &E.undo.rec[E.undo.current - 1];
+    if (r->type != type || r->row != at || memchr(r->text, '\n', r->len))
+        return 0;
+
+    int prepend;
+    if (type == UNDO_INSERT && col == r->col + r->len)
+        prepend = 0; //连续输入
+    else if (type == UNDO_DELETE && col == r->col)
+        prepend = 0; //连续按Delete
+    else if (type == UNDO_DELETE && col + 1 == r->col)
+        prepend = 1; //连续按Backspace
+    else
+        return 0;
+
+    if (r->len + 1 > r->cap)
+    {
+        int newcap = r->cap * 2;
+        E.undo.mem += newcap - r->cap;
+        r->text = realloc(r->text, newcap);
+        r->cap = newcap;
+    }
+    if (prepend)
+    {
+        memmove(&r->text[1], r->text, r->len);
+        r->text[0] = s[0];
+        r->col = col;
+    }
+    else
+    {
+        r->text[r->len] = s[0];
+    }
+    r->len++;
+    return 1;
+}
+
+/*追加一条记录，text有len + rlen字节的空间由调用者填写。填好后调用editorUndoTrim*/
+undoRecord *editorUndoAdd(int type, int at, int col, int len, int rlen)
+{
+    //新的编辑使重做记录失效
+    while (E.undo.len > E.undo.current)
+        editorUndoFreeRecord(&E.undo.rec[--E.undo.len]);
+
+    if (E.undo.len == E.undo.cap)
+    {
+        E.undo.cap = E.undo.cap ? E.undo.cap * 2 : 64;
+        E.undo.rec = realloc(E.undo.rec, sizeof(undoRecord) * E.undo.cap);
+    }
+    undoRecord *r = &E.undo.rec[E.undo.len++];
+    r->type = type;
+    r->group = E.undo.depth > 0 ? E.undo.group : ++E.undo.group;
+    r->row = at;
+    r->col = col;
+    r->len = len;
+    r->rlen = rlen;
+    r->cap = len + rlen < 16 ? 16 : len + rlen;
+    r->text = malloc(r->cap);
+    r->cx = E.cx;
+    r->cy = E.cy;
+    E.undo.current = E.undo.len;
+    E.undo.mem += sizeof(undoRecord) + r->cap;
+    return r;
+}
+
+/*记录一次编辑：editorInsertText在插入之前调用，editorDeleteText在删除之后带着删掉的文本调用。
+记下的光标都是编辑之前的位置*/
+void editorUndoPush(int type, int at, int col, const char *s, int len)
+{
+    if (E.undo.replaying)
+        return;
+    if (editorUndoCoalesce(type, at, col, s, len))
+        return;
+    undoRecord *r = editorUndoAdd(type, at, col, len, 0);
+    memcpy(r->text, s, len);
+    E.undo.coalesce = (len == 1 && s[0] != '\n');
+    editorUndoTrim();
+}
+
+//记录一次行内替换：(at,col)起的oldlen个字符old换成了s，由editorReplaceText调用
+void editorUndoPushReplace(int at, int col, const char *old, int oldlen, const char *s, int len)
+{
+    if (E.undo.replaying)
+        return;
+    undoRecord *r = editorUndoAdd(UNDO_REPLACE, at, col, oldlen, len);
+    memcpy(r->text, old, oldlen);
+    memcpy(r->text + oldlen, s, len);
+    E.undo.coalesce = 0;
+    editorUndoTrim();
+}
+
+//计算插入文本后的末尾位置
+void editorTextEnd(undoRecord *r, int *at, int *col)
+{
+    *at = r->row;
+    *col = r->col;
+    int i;
+    for (i = 0; i < r->len; i++)
+    {
+        if (r->text[i] == '\n')
+        {
+            (*at)++;
+            *col = 0;
+        }
+        else
+        {
+            (*col)++;
+        }
+    }
+}
+
+void editorUndo()
+{
+    if (E.undo.current == 0)
+    {
+        editorSetStatusMessage("Already at oldest change");
+        return;
+    }
+    E.undo.replaying = 1;
+    int group = E.undo.rec[E.undo.current - 1].group;
+    undoRecord *r = NULL;
+    //逆序执行同组记录的逆操作
+    while (E.undo.current > 0 && E.undo.rec[E.undo.current - 1].group == group)
+    {
+        r = &E.undo.rec[--E.undo.current];
+        if (r->type == UNDO_INSERT)
+            free(editorDeleteText(r->row, r->col, r->len, NULL));
+        else if (r->type == UNDO_DELETE)
+            editorInsertText(r->row, r->col, r->text, r->len);
+        else
+            editorReplaceText(r->row, r->col, r->rlen, r->text, r->len);
+    }
+    E.undo.replaying = 0;
+    E.undo.coalesce = 0;
+    E.cx = r->cx;
+    E.cy = r->cy;
+    editorSetStatusMessage("undo");
+}
+
+void editorRedo()
+{
+    if (E.undo.current == E.undo.len)
+    {
+        editorSetStatusMessage("Already at newest change");
+        return;
+    }
+    E.undo.replaying = 1;
+    int group = E.undo.rec[E.undo.current].group;
+    undoRecord *r = NULL;
+    while (E.undo.current < E.undo.len && E.undo.rec[E.undo.current].group == group)
+    {
+        r = &E.undo.rec[E.undo.current++];
+        if (r->type == UNDO_INSERT)
+            editorInsertText(r->row, r->col, r->text, r->len);
+        else if (r->type == UNDO_DELETE)
+            free(editorDeleteText(r->row, r->col, r->len, NULL));
+        else
+            editorReplaceText(r->row, r->col, r->len, r->text + r->len, r->rlen);
+    }
+    E.undo.replaying = 0;
+    E.undo.coalesce = 0;
+    //光标移到最后一次编辑之后
+    if (r->type == UNDO_INSERT)
+    {
+        editorTextEnd(r, &E.cy, &E.cx);
+    }
+    else
+    {
+        E.cy = r->row;
+        E.cx = r->type == UNDO_REPLACE ? r->col + r->rlen : r->col;
+    }
+    editorSetStatusMessage("redo");
+}
+/*** loader ***/
+void editorChunkAddRow(loadChunk *c, char *line, char *eol)
+{
+    //去掉行尾的\r
+    while (eol > line && eol[-1] == '\r')
+        eol--;
+    rowLeaf *leaf = c->n ? c->leaves[c->n - 1] : NULL;
+    if (leaf == NULL || leaf->h.n == ROW_FANOUT || eol - leaf->base > INT_MAX)
+    {
+        if (c->n == c->cap)
+        {
+            c->cap = c->cap ? c->cap * 2 : 64;
+            c->leaves = realloc(c->leaves, sizeof(rowLeaf *) * c->cap);
+        }
+        leaf = (rowLeaf *)rowNodeNew(1);
+        leaf->base = line;
+        c->leaves[c->n++] = leaf;
+    }
+    leaf->size[leaf->h.n] = eol - line;
+    leaf->text[leaf->h.n++].off = line - leaf->base;
+    leaf->h.rows++;
+    leaf->h.bytes += eol - line + 1;
+}
+
+//把一块文本切分成行，每行直接引用原始文本。SSE2一次比较16个字节，再逐个取出换行的位置
+void *editorSplitChunk(void *arg)
+{
+    loadChunk *c = arg;
+    char *p = c->start;
+    char *line = p;
+    char *end = c->end;
+#ifdef __SSE2__
+    const __m128i nl = _mm_set1_epi8('\n');
+    while (end - p >= 16)
+    {
+        unsigned mask = _mm_movemask_epi8(
+            _mm_cmpeq_epi8(_mm_loadu_si128((const __m128i *)p), nl));
+        while (mask)
+        {
+            char *eol = p + __builtin_ctz(mask);
+            editorChunkAddRow(c, line, eol);
+            line = eol + 1;
+            mask &= mask - 1;
+        }
+        p += 16;
+    }
+#endif
+    char *eol;
+    while (p < end && (eol = memchr(p, '\n', end - p)) != NULL)
+    {
+        editorChunkAddRow(c, line, eol);
+        line = p = eol + 1;
+    }
+    //文件最后一行没有换行
+    if (line < end)
+        editorChunkAddRow(c, line, end);
+    return NULL;
+}
+
+//从p开始至少延伸len字节，并把块尾对齐到下一个换行之后
+char *editorChunkEnd(char *p, size_t len, char *end)
+{
+    if ((size_t)(end - p) <= len)
+        return end;
+    char *nl = memchr(p + len, '\n', end - (p + len));
+    return nl ? nl + 1 : end;
+}
+
+//把一块的行按顺序追加到行索引
+void editorChunkMerge(loadChunk *c)
+{
+    long long start = E.rowroot ? E.rowroot->bytes : 0;
+    int i;
+    for (i = 0; i < c->n; i++)
+        rowTreeAppendLeaf(c->leaves[i]);
+    long long bytes = (E.rowroot ? E.rowroot->bytes : 0) - start;
+    //切分时去掉了\r或补上了最后一行的换行，这一块不再与磁盘上的内容逐字节相同
+    if (bytes != c->end - c->start || (c->end > c->start && c->end[-1] != '\n'))
+    {
+        if (start < E.savehead)
+            E.savehead = start;
+        E.savetail = 0;
+    }
+    else
+    {
+        E.savetail += bytes;
+    }
+    free(c->leaves);
+    c->leaves = NULL;
+    c->n = c->cap = 0;
+    E.origscan = c->end - E.orig;
+}
+
+/*把[p,end)分成最多nthreads块，每个线程切分一块，返回块数。
+块的边界对齐到换行之后，调用者按顺序合并*/
+int editorSplitParallel(char *p, char *end, loadChunk *chunk, int nthreads)
+{
+    size_t len = end - p;
+    if ((size_t)nthreads > len / KILO_LOAD_CHUNK)
+        nthreads = len / KILO_LOAD_CHUNK;
+    if (nthreads < 1)
+        nthreads = 1;
+    int i;
+    for (i = 0; i < nthreads; i++)
+    {
+        memset(&chunk[i], 0, sizeof(loadChunk));
+        chunk[i].start = p;
+        chunk[i].end = i == nthreads - 1 ? end : editorChunkEnd(p, len / nthreads, end);
+        p = chunk[i].end;
+    }
+    //第0块由当前线程处理
+    for (i = 1; i < nthreads; i++)
+        if (pthread_create(&chunk[i].tid, NULL, editorSplitChunk, &chunk[i]) != 0)
+            chunk[i].tid = 0;
+    editorSplitChunk(&chunk[0]);
+    for (i = 1; i < nthreads; i++)
+    {
+        if (chunk[i].tid)
+            pthread_join(chunk[i].tid, NULL);
+        else
+            editorSplitChunk(&chunk[i]);
+    }
+    return nthreads;
+}
+
+/*后台切分线程：从第一屏之后开始，每次并行切分一大块，把结果按顺序放进队列。
+行索引只由主线程修改，主线程在空闲时或需要某些行时再把队列里的块合并进来*/
+void *editorLoaderThread(void *arg)
+{
+    char *p = arg;
+    char *end = E.orig + E.origlen;
+    while (p < end)
+    {
+        loadChunk chunk[KILO_LOAD_MAX_THREADS];
+        char *blockend = editorChunkEnd(p, (size_t)KILO_LOAD_CHUNK * E.loadthreads, end);
+        int n = editorSplitParallel(p, blockend, chunk, E.loadthreads);
+        p = blockend;
+
+        pthread_mutex_lock(&E.load.lock);
+        if (E.load.qlen + n > E.load.qcap)
+        {
+            E.load.qcap = (E.load.qlen + n) * 2;
+            E.load.queue = realloc(E.load.queue, sizeof(loadChunk) * E.load.qcap);
+        }
+        memcpy(&E.load.queue[E.load.qlen], chunk, sizeof(loadChunk) * n);
+        E.load.qlen += n;
+        pthread_cond_signal(&E.load.cond);
+        pthread_mutex_unlock(&E.load.lock);
+        editorWake();
+    }
+    pthread_mutex_lock(&E.load.lock);
+    E.load.active = 0;
+    pthread_cond_signal(&E.load.cond);
+    pthread_mutex_unlock(&E.load.lock);
+    editorWake();
+    return NULL;
+}
+
+//从当前位置开始在后台切分文件的其余部分
+void editorLoadStart()
+{
+    if (editorLoaded())
+        return;
+    pthread_t tid;
+    E.load.active = 1;
+    if (pthread_create(&tid, NULL, editorLoaderThread, E.orig + E.origscan) != 0)
+    {
+        E.load.active = 0;
+        return;
+    }
+    pthread_detach(tid);
+}
+
+//后台线程还在切分或队列中还有块没有合并。active和qlen由后台线程修改，加锁读取
+int editorLoadBusy()
+{
+    pthread_mutex_lock(&E.load.lock);
+    int busy = E.load.active || E.load.qlen;
+    pthread_mutex_unlock(&E.load.lock);
+    return busy;
+}
+
+/*把后台线程已经切分好的块合并到行索引。wait为真时，若队列为空则等待下一批。
+返回合并的块数*/
+int editorLoadMerge(int wait)
+{
+    pthread_mutex_lock(&E.load.lock);
+    if (!E.load.active && E.load.qlen == 0)
+    {
+        pthread_mutex_unlock(&E.load.lock);
+        return 0;
+    }
+    while (wait && E.load.qlen == 0 && E.load.active)
+        pthread_cond_wait(&E.load.cond, &E.load.lock);
+    int n = E.load.qlen;
+    loadChunk *queue = E.load.queue;
+    E.load.queue = NULL;
+    E.load.qlen = E.load.qcap = 0;
+    pthread_mutex_unlock(&E.load.lock);
+
+    int i;
+    for (i = 0; i < n; i++)
+        editorChunkMerge(&queue[i]);
+    free(queue);
+    return n;
+}
+
+//已合并部分占整个文件的百分比
+int editorLoadPercent()
+{
+    return E.origlen ? (int)(E.origscan * 100 / E.origlen) : 100;
+}
+
+/*保证总行数达到rows或文件已全部切分。后台线程在工作时，只等待它切分到需要的位置；
+否则就在当前线程按块切分。行号取决于前面所有的换行，行索引只能按顺序从文件开头切分，
+所以跳到还没有切分的行（包括@偏移跳转）时要等到它之前的部分都切分完*/
+void editorLoadRows(int rows)
+{
+    char *end = E.orig + E.origlen;
+    while (E.numrows < rows && !editorLoaded())
+    {
+        if (editorLoadBusy())
+        {
+            editorLoadMerge(1);
+            continue;
+        }
+        loadChunk c = {0};
+        c.start = E.orig + E.origscan;
+        c.end = editorChunkEnd(c.start, KILO_LOAD_BLOCK, end);
+        editorSplitChunk(&c);
+        editorChunkMerge(&c);
+    }
+}
+
+//切分剩下的整个文件，没有后台线程时按线程数并行切分后按顺序合并
+void editorLoadAll()
+{
+    if (editorLoadBusy())
+    {
+        editorLoadRows(INT_MAX);
+        return;
+    }
+    loadChunk chunk[KILO_LOAD_MAX_THREADS];
+    int n = editorSplitParallel(E.orig + E.origscan, E.orig + E.origlen,
+                                chunk, E.loadthreads);
+    int i;
+    for (i = 0; i < n; i++)
+        editorChunkMerge(&chunk[i]);
+}
+
+/*** file i/o ***/
+//读入整个文件作为只读的原始文本
+char *editorReadFile(int fd, size_t *len)
+{
+    struct stat st;
+    size_t cap = (fstat(fd, &st) == 0 && st.st_size > 0) ? st.st_size + 1 : 65536;
+    char *buf = malloc(cap);
+    size_t n = 0;
+    ssize_t r;
+    while ((r = read(fd, &buf[n], cap - n)) != 0)
+    {
+        if (r == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            die("read");
+        }
+        n += r;
+        //文件大小未知（管道等）或正在增长，扩大缓冲区
+        if (n == cap)
+        {
+            cap *= 2;
+            buf = realloc(buf, cap);
+        }
+    }
+    *len = n;
+    return buf;
+}
+
+//文件是否已全部切分成行
+int editorLoaded()
+{
+    return E.origscan >= E.origlen;
+}
+
+void editorOpen(char *filename)
+{ //保存路径
+    free(E.filename);
+    E.filename = strdup(filename);
+
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1)
+        die("open");
+    struct stat st;
+    E.savehead = LLONG_MAX;
+    E.savetail = 0;
+    E.diskvalid = fstat(fd, &st) == 0 && S_ISREG(st.st_mode);
+    if (E.diskvalid)
+        E.disk = st;
+    if (E.diskvalid && st.st_size > 0)
+    { //普通文件直接映射到内存，未修改的行引用映射，不复制也不预先读入
+        E.orig = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (E.orig != MAP_FAILED)
+        {
+            E.origlen = st.st_size;
+            E.origmapped = 1;
+            E.origdev = st.st_dev;
+            E.origino = st.st_ino;
+            madvise(E.orig, E.origlen, MADV_SEQUENTIAL);
+        }
+    }
+    //不能映射的文件（管道、设备等）一次读入
+    if (!E.origmapped)
+        E.orig = editorReadFile(fd, &E.origlen);
+    close(fd);
+
+    //先切分第一屏，其余部分交给后台线程
+    editorLoadRows(E.screenrows + 1);
+    editorLoadStart();
+    E.dirty = 0;
+    //上次没有保存就退出时留下了日志，询问是否恢复
+    editorJournalOpen();
+}
+
+//把p开始的len字节加入保存快照，与上一片段在内存中相连时直接合并
+void editorSaveAdd(struct saveState *S, const char *p, size_t len)
+{
+    if (S->nseg > 0)
+    {
+        struct iovec *v = &S->seg[S->nseg - 1];
+        if ((char *)v->iov_base + v->iov_len == p)
+        {
+            v->iov_len += len;
+            return;
+        }
+    }
+    if (S->nseg == S->segcap)
+    {
+        S->segcap = S->segcap ? S->segcap * 2 : 64;
+        S->seg = realloc(S->seg, sizeof(struct iovec) * S->segcap);
+    }
+    S->seg[S->nseg].iov_base = (char *)p;
+    S->seg[S->nseg].iov_len = len;
+    S->nseg++;
+}
+
+//修改过的行会继续被编辑，把它连同换行复制到快照的chunk中
+void editorSaveCopy(struct saveState *S, const char *p, size_t len)
+{
+    if (S->nchunk == 0 || S->chunkused + len + 1 > KILO_SAVE_CHUNK)
+    {
+        S->chunk = realloc(S->chunk, sizeof(char *) * (S->nchunk + 1));
+        S->chunk[S->nchunk++] = malloc(len + 1 > KILO_SAVE_CHUNK ? len + 1 : KILO_SAVE_CHUNK);
+        S->chunkused = 0;
+    }
+    char *q = S->chunk[S->nchunk - 1] + S->chunkused;
+    memcpy(q, p, len);
+    q[len] = '\n';
+    S->chunkused += len + 1;
+    editorSaveAdd(S, q, len + 1);
+}
+
+//建立第first行到第last-1行的快照。未修改的行引用只读的原始文本，相邻的行合并成一个片段
+void editorSaveSnapshot(struct saveState *S, int first, int last)
+{
+    char *end = E.orig + E.origlen;
+    int j;
+    S->total = 0;
+    for (j = first; j < last; j++)
+    {
+        erow row = editorRow(j);
+        if (row.cap)
+            editorSaveCopy(S, row.chars, row.size);
+        else if (row.chars + row.size < end && row.chars[row.size] == '\n')
+            editorSaveAdd(S, row.chars, row.size + 1);
+        else
+        { //\r\n结尾或没有换行的最后一行
+            if (row.size)
+                editorSaveAdd(S, row.chars, row.size);
+            editorSaveAdd(S, "\n", 1);
+        }
+        S->total += row.size + 1;
+    }
+}
+
+//保存的目标是否就是当前映射的文件
+int editorSavingMapped()
+{
+    struct stat st;
+    return E.origmapped && stat(E.filename, &st) == 0 &&
+           st.st_dev == E.origdev && st.st_ino == E.origino;
+}
+
+/*就地改写正在被映射的文件时，映射中没有被复制过的页会随文件内容改变。
+第first到last-1行中仍引用原始文本的行，在新文件中位置不变的写回的是相同的字节，
+可以继续引用；位置移动了的复制一份。editorSaveMethod限制了改写的范围，复制的量有上限*/
+void editorSaveDetach(int first, int last)
+{
+    if (first >= last)
+        return;
+    long long off = editorRowOffset(first);
+    int moved = 0;
+    int j;
+    for (j = first; j < last; j++)
+    {
+        erow row = editorRow(j);
+        if (row.cap == 0 && row.chars != E.orig + off)
+        {
+            if (!moved++) //查找线程可能正在读取这些行
+                editorSearchEditBegin();
+            editorRowReserve(j, row.size);
+        }
+        off += row.size + 1;
+    }
+    //内容不变，不必重新扫描
+    if (moved)
+        editorSearchEditEnd(first, 0, 0);
+}
+
+/*选择保存方式。磁盘上的文件自上次打开或保存后没有被改动过时，可以只改写修改过的部分：
+总长不变时就地覆盖[savehead, 总长-savetail)，否则从savehead重写到文件末尾再截断。
+要改写的部分超过文件的1/KILO_SAVE_DELTA_DIV时就地改写省不了多少，
+还要在主线程复制移动了的行，这时也完整写临时文件*/
+int editorSaveMethod()
+{
+    struct stat st;
+    if (E.savemode == SAVE_ATOMIC || !E.diskvalid || stat(E.filename, &st) == -1 ||
+        st.st_dev != E.disk.st_dev || st.st_ino != E.disk.st_ino ||
+        st.st_size != E.disk.st_size || st.st_mtim.tv_sec != E.disk.st_mtim.tv_sec ||
+        st.st_mtim.tv_nsec != E.disk.st_mtim.tv_nsec)
+        return SAVE_ATOMIC;
+    long long total = E.rowroot ? E.rowroot->bytes : 0;
+    int method = total == (long long)E.disk.st_size ? SAVE_PATCH : SAVE_DELTA;
+    long long end = method == SAVE_PATCH ? total - E.savetail : total;
+    if (end - E.savehead > total / KILO_SAVE_DELTA_DIV)
+        return SAVE_ATOMIC;
+    return method;
+}
+
+//第first到last行已修改，缩小下次增量保存需要改写的范围
+void editorSaveTouch(int first, int last)
+{
+    if (E.savehead > 0)
+    {
+        long long off = editorRowOffset(first);
+        if (off < E.savehead)
+            E.savehead = off;
+    }
+    if (E.savetail > 0)
+    {
+        long long total = E.rowroot ? E.rowroot->bytes : 0;
+        long long end = last + 1 < E.numrows ? editorRowOffset(last + 1) : total;
+        if (total - end < E.savetail)
+            E.savetail = total - end;
+    }
+}
+
+//释放快照，准备下一次保存
+void editorSaveRelease(struct saveState *S)
+{
+    int i;
+    for (i = 0; i < S->nchunk; i++)
+        free(S->chunk[i]);
+    free(S->chunk);
+    free(S->seg);
+    free(S->filename);
+    free(S->tmpname);
+    S->chunk = NULL;
+    S->seg = NULL;
+    S->filename = S->tmpname = NULL;
+    S->nchunk = S->nseg = S->segcap = 0;
+    S->chunkused = 0;
+}
+
+//fsync文件所在的目录，让改名本身也落盘
+void editorSyncDir(const char *filename)
+{
+    const char *slash = strrchr(filename, '/');
+    char dir[PATH_MAX];
+    if (slash == NULL)
+        strcpy(dir, ".");
+    else if (slash == filename)
+        strcpy(dir, "/");
+    else
+        snprintf(dir, sizeof(dir), "%.*s", (int)(slash - filename), filename);
+    int fd = open(dir, O_RDONLY | O_DIRECTORY);
+    if (fd != -1)
+    {
+        fsync(fd);
+        close(fd);
+    }
+}
+
+//把快照依次写入fd，每次writev最多KILO_SAVE_BLOCK字节，处理部分写入
+int editorSaveWrite(struct saveState *S, int fd)
+{
+    struct iovec iov[KILO_SAVE_IOV];
+    int i = 0;
+    size_t off = 0; //seg[i]已写出的字节数
+    while (i < S->nseg)
+    {
+        int cnt = 0;
+        size_t room = KILO_SAVE_BLOCK;
+        int k = i;
+        size_t o = off;
+        while (k < S->nseg && cnt < KILO_SAVE_IOV && room > 0)
+        {
+            size_t len = S->seg[k].iov_len - o;
+            if (len > room)
+                len = room;
+            iov[cnt].iov_base = (char *)S->seg[k].iov_base + o;
+            iov[cnt].iov_len = len;
+            cnt++;
+            room -= len;
+            k++;
+            o = 0;
+        }
+        ssize_t n = writev(fd, iov, cnt);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        __atomic_add_fetch(&S->written, n, __ATOMIC_RELAXED);
+        editorWake(); //刷新进度
+        while (n > 0)
+        {
+            size_t left = S->seg[i].iov_len - off;
+            if ((size_t)n < left)
+            {
+                off += n;
+                break;
+            }
+            n -= left;
+            i++;
+            off = 0;
+        }
+    }
+    return 0;
+}
+
+/*写临时文件，fsync后改名替换目标文件。中途失败或崩溃时目标文件保持原样；
+未修改的行引用的映射在改名后依然有效*/
+int editorSaveAtomic(struct saveState *S)
+{
+    int err = 0;
+    int fd = open(S->tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1)
+        return errno;
+    struct stat st;
+    if (stat(S->filename, &st) == 0)
+        fchmod(fd, st.st_mode & 07777);
+    if (editorSaveWrite(S, fd) == -1 || fsync(fd) == -1 || fstat(fd, &S->st) == -1)
+        err = errno;
+    if (close(fd) == -1 && !err)
+        err = errno;
+    if (!err && rename(S->tmpname, S->filename) == -1)
+        err = errno;
+    if (err)
+        unlink(S->tmpname);
+    else
+        editorSyncDir(S->filename);
+    return err;
+}
+
+//从offset处就地改写目标文件，长度变化时截断到新的长度
+int editorSaveInPlace(struct saveState *S)
+{
+    int err = 0;
+    int fd = open(S->filename, O_WRONLY);
+    if (fd == -1)
+        return errno;
+    if (lseek(fd, S->offset, SEEK_SET) == -1 || editorSaveWrite(S, fd) == -1 ||
+        (S->method == SAVE_DELTA && ftruncate(fd, S->size) == -1) || fsync(fd) == -1 ||
+        fstat(fd, &S->st) == -1)
+        err = errno;
+    if (close(fd) == -1 && !err)
+        err = errno;
+    return err;
+}
+
+void *editorSaveThread(void *arg)
+{
+    struct saveState *S = arg;
+    S->err = S->method == SAVE_ATOMIC ? editorSaveAtomic(S) : editorSaveInPlace(S);
+    __atomic_store_n(&S->done, 1, __ATOMIC_RELEASE);
+    editorWake();
+    return NULL;
+}
+
+//输入文件名后保存
+void editorSaveAs(char *filename)
+{
+    if (filename == NULL)
+    {
+        editorSetStatusMessage("Save aborted");
+        return;
+    }
+    E.filename = filename;
+    editorSave();
+}
+
+void editorSave()
+{
+    struct saveState *S = &E.save;
+    if (E.filename == NULL)
+    { //change
+        editorPrompt("Save as: %s (ESC to cancel)", NULL, editorSaveAs);
+        return;
+    }
+    //上一次保存还在写，等它完成后用那时的内容再保存一次
+    if (S->running)
+    {
+        S->again = 1;
+        return;
+    }
+    editorLoadAll();
+    S->method = editorSaveMethod();
+    S->size = E.rowroot ? E.rowroot->bytes : 0;
+    int first = 0, last = E.numrows, col;
+    if (S->method == SAVE_ATOMIC)
+    {
+        S->offset = 0;
+    }
+    else
+    { //savehead之前的行与磁盘上相同，它们是行首，从这里开始改写
+        S->offset = E.savehead < S->size ? E.savehead : S->size;
+        first = editorRowFromOffset(S->offset, &col);
+        if (S->method == SAVE_PATCH && S->size - E.savetail > S->offset)
+            last = editorRowFromOffset(S->size - E.savetail, &col);
+        else if (S->method == SAVE_PATCH)
+            last = first;
+        if (editorSavingMapped())
+            editorSaveDetach(first, last);
+    }
+    editorSaveSnapshot(S, first, last);
+    editorJournalSaveBegin();
+    S->head = E.savehead;
+    S->tail = E.savetail;
+    //保存完成后磁盘上就是现在的内容，之后的修改重新记录
+    E.savehead = LLONG_MAX;
+    E.savetail = S->size;
+    S->filename = strdup(E.filename);
+    S->tmpname = malloc(strlen(E.filename) + 6);
+    sprintf(S->tmpname, "%s.tmp~", E.filename);
+    S->dirty = E.dirty;
+    S->written = 0;
+    S->done = 0;
+    S->lastpct = -1;
+    S->running = 1;
+    S->threaded = pthread_create(&S->tid, NULL, editorSaveThread, S) == 0;
+    if (!S->threaded) //无法创建线程时直接在主线程写
+        editorSaveThread(S);
+    editorSavePoll(0);
+}
+
+/*主线程定期调用：显示保存进度，保存线程结束后回收它并显示结果。wait非0时等待保存完成。
+保存期间的修改不会被清除，需要重绘时返回1*/
+int editorSavePoll(int wait)
+{
+    struct saveState *S = &E.save;
+    if (!S->running)
+        return 0;
+    if (!wait && !__atomic_load_n(&S->done, __ATOMIC_ACQUIRE))
+    {
+        size_t written = __atomic_load_n(&S->written, __ATOMIC_RELAXED);
+        int pct = S->total ? (int)(written * 100 / S->total) : 0;
+        if (pct == S->lastpct)
+            return 0;
+        S->lastpct = pct;
+        editorSetStatusMessage("Saving %s: %d%%", S->filename, pct);
+        return 1;
+    }
+    if (S->threaded)
+        pthread_join(S->tid, NULL);
+    S->running = 0;
+    if (S->err)
+    {
+        editorSetStatusMessage("Can't save! I/O error: %s", strerror(S->err));
+        if (S->method == SAVE_ATOMIC)
+        { //原文件没有变化，恢复快照前记录的修改范围
+            if (S->head < E.savehead)
+                E.savehead = S->head;
+            if (S->tail < E.savetail)
+                E.savetail = S->tail;
+        }
+        else
+        { //原文件可能已被部分改写，下次完整重写
+            E.diskvalid = 0;
+        }
+    }
+    else
+    {
+        E.dirty -= S->dirty;
+        E.disk = S->st;
+        E.diskvalid = 1;
+        if (S->method == SAVE_ATOMIC)
+            editorSetStatusMessage("%zu bytes written to disk", S->total);
+        else
+            editorSetStatusMessage("%lld bytes written to disk (%zu rewritten in place)",
+                                   S->size, S->total);
+    }
+    editorJournalSaveEnd(!S->err);
+    editorSaveRelease(S);
+    if (S->again)
+    {
+        S->again = 0;
+        editorSave();
+    }
+    return 1;
+}
+
+//等待正在进行的保存完成，退出前调用
+void editorSaveWait()
+{
+    while (E.save.running)
+        editorSavePoll(1);
+}
+
+/*** journal ***/
+/*崩溃恢复日志“文件名.swp~”：文件头记录日志所基于的磁盘文件，之后每次编辑追加一条记录。
+记录先放在内存中，空闲一段时间或积累够多后由后台线程写出并fsync，按键时只有一次内存复制。
+保存成功后日志清空，改以新保存的文件为基础*/
+
+//FNV-1a校验和，用来识别崩溃时写了一半的记录
+unsigned journalSum(const char *p, size_t len)
+{
+    unsigned h = 2166136261u;
+    size_t i;
+    for (i = 0; i < len; i++)
+        h = (h ^ (unsigned char)p[i]) * 16777619u;
+    return h;
+}
+
+//把一条记录追加到buf
+void journalPack(char **buf, size_t *len, size_t *cap, int type, long long a, long long b,
+                 const char *s, int n)
+{
+    size_t need = *len + sizeof(journalRecord) + n + sizeof(unsigned);
+    if (need > *cap)
+    {
+        *cap = need > *cap * 2 ? need : *cap * 2;
+        *buf = realloc(*buf, *cap);
+    }
+    journalRecord r = {type, n, a, b};
+    char *p = *buf + *len;
+    memcpy(p, &r, sizeof(r));
+    if (n)
+        memcpy(p + sizeof(r), s, n);
+    unsigned sum = journalSum(p, sizeof(r) + n);
+    memcpy(p + sizeof(r) + n, &sum, sizeof(sum));
+    *len = need;
+}
+
+//以当前磁盘上的文件为基础的文件头
+journalHeader journalBase()
+{
+    journalHeader h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, KILO_JOURNAL_MAGIC, sizeof(h.magic));
+    h.size = E.disk.st_size;
+    h.ino = E.disk.st_ino;
+    h.sec = E.disk.st_mtim.tv_sec;
+    h.nsec = E.disk.st_mtim.tv_nsec;
+    return h;
+}
+
+//后台线程：等待写出请求，把积累的记录写入日志并fsync
+void *editorJournalThread(void *arg)
+{
+    struct journalState *J = arg;
+    pthread_mutex_lock(&J->lock);
+    while (1)
+    {
+        while (!J->flush)
+            pthread_cond_wait(&J->cond, &J->lock);
+        //取走积累的记录，写文件时主线程可以继续追加
+        char *buf = J->buf;
+        size_t len = J->len;
+        int reset = J->reset;
+        J->buf = NULL;
+        J->len = J->cap = 0;
+        J->flush = 0;
+        J->reset = 0;
+        J->busy = 1;
+        pthread_mutex_unlock(&J->lock);
+
+        if (reset)
+            ftruncate(J->fd, 0);
+        size_t off = 0;
+        while (off < len)
+        {
+            ssize_t n = write(J->fd, buf + off, len - off);
+            if (n == -1)
+            {
+                if (errno == EINTR)
+                    continue;
+                break;
+            }
+            off += n;
+        }
+        fdatasync(J->fd);
+        free(buf);
+
+        pthread_mutex_lock(&J->lock);
+        J->busy = 0;
+        pthread_cond_broadcast(&J->done);
+    }
+    return NULL;
+}
+
+//启动写日志的后台线程
+int editorJournalStart()
+{
+    struct journalState *J = &E.journal;
+    pthread_t tid;
+    if (!J->active)
+    {
+        if (pthread_create(&tid, NULL, editorJournalThread, J) != 0)
+            return -1;
+        pthread_detach(tid);
+        J->active = 1;
+    }
+    return 0;
+}
+
+//当前文件的日志文件名
+void journalSetPath()
+{
+    struct journalState *J = &E.journal;
+    free(J->path);
+    J->path = malloc(strlen(E.filename) + 6);
+    sprintf(J->path, "%s.swp~", E.filename);
+}
+
+//第一次编辑时创建日志文件，失败时不再记录
+int editorJournalCreate()
+{
+    struct journalState *J = &E.journal;
+    if (J->fd != -1)
+        return 0;
+    if (J->failed || E.filename == NULL || !E.diskvalid)
+        return -1;
+    //新文件在第一次保存后才有日志
+    if (J->path == NULL)
+        journalSetPath();
+    J->fd = open(J->path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0600);
+    if (J->fd == -1 || editorJournalStart() == -1)
+    {
+        if (J->fd != -1)
+            close(J->fd);
+        J->fd = -1;
+        J->failed = 1;
+        return -1;
+    }
+    journalHeader h = journalBase();
+    pthread_mutex_lock(&J->lock);
+    if (J->len + sizeof(h) > J->cap)
+    {
+        J->cap = J->len + sizeof(h) + 4096;
+        J->buf = realloc(J->buf, J->cap);
+    }
+    memcpy(J->buf + J->len, &h, sizeof(h));
+    J->len += sizeof(h);
+    pthread_mutex_unlock(&J->lock);
+    J->size = sizeof(h);
+    return 0;
+}
+
+//记录一次编辑。只复制到内存，写盘留给后台线程
+void editorJournalAppend(int type, long long a, long long b, const char *s, int n)
+{
+    struct journalState *J = &E.journal;
+    if (J->replaying || editorJournalCreate() == -1)
+        return;
+    pthread_mutex_lock(&J->lock);
+    size_t before = J->len;
+    journalPack(&J->buf, &J->len, &J->cap, type, a, b, s, n);
+    //保存期间的记录要同时留给新的日志
+    if (J->saving)
+        journalPack(&J->since, &J->sincelen, &J->sincecap, type, a, b, s, n);
+    J->size += J->len - before;
+    if (J->len >= KILO_JOURNAL_BATCH && !J->flush)
+    {
+        J->flush = 1;
+        pthread_cond_signal(&J->cond);
+    }
+    pthread_mutex_unlock(&J->lock);
+    clock_gettime(CLOCK_MONOTONIC, &J->last);
+    J->idle = 0;
+}
+
+//记录一次行内替换：被替换的长度写在新文本之前
+void editorJournalAppendReplace(int at, int col, int oldlen, const char *s, int len)
+{
+    struct journalState *J = &E.journal;
+    if (J->replaying)
+        return;
+    char stack[256];
+    char *buf = len + sizeof(int) <= sizeof(stack) ? stack : malloc(len + sizeof(int));
+    memcpy(buf, &oldlen, sizeof(int));
+    memcpy(buf + sizeof(int), s, len);
+    editorJournalAppend(JOURNAL_REPLACE, at, col, buf, len + sizeof(int));
+    if (buf != stack)
+        free(buf);
+}
+
+//用新的内容（文件头加记录）替换整个日志
+void editorJournalReplace(char *buf, size_t len, size_t cap)
+{
+    struct journalState *J = &E.journal;
+    pthread_mutex_lock(&J->lock);
+    free(J->buf);
+    J->buf = buf;
+    J->len = len;
+    J->cap = cap;
+    J->reset = 1;
+    J->flush = 1;
+    pthread_cond_signal(&J->cond);
+    pthread_mutex_unlock(&J->lock);
+    J->size = len;
+}
+
+/*日志过长而修改过的部分不大时压缩：磁盘上的文件与缓冲区只在[savehead, 总长-savetail)
+不同，整个日志换成一条用这段内容替换原文件相应部分的记录，恢复时间只与这段的大小有关*/
+void editorJournalCompact()
+{
+    struct journalState *J = &E.journal;
+    if (J->fd == -1 || J->size < KILO_JOURNAL_COMPACT || E.save.running || !E.diskvalid ||
+        !editorLoaded())
+        return;
+    long long total = E.rowroot ? E.rowroot->bytes : 0;
+    long long head = E.savehead < total ? E.savehead : total;
+    long long end = total - E.savetail > head ? total - E.savetail : head;
+    //恢复时要删除原文件中的对应部分，它的长度也不能超过int
+    if ((end - head) * 2 > (long long)J->size || E.disk.st_size - E.savetail - head > INT_MAX)
+        return;
+    char *text = malloc(end - head + 1);
+    size_t n = 0;
+    int col;
+    int j = editorRowFromOffset(head, &col);
+    for (; n < (size_t)(end - head); j++)
+    {
+        erow row = editorRow(j);
+        if (row.size)
+            memcpy(text + n, row.chars, row.size);
+        n += row.size;
+        text[n++] = '\n';
+    }
+    journalHeader h = journalBase();
+    size_t cap = sizeof(h) + sizeof(journalRecord) + n + sizeof(unsigned);
+    char *buf = malloc(cap);
+    size_t len = sizeof(h);
+    memcpy(buf, &h, sizeof(h));
+    journalPack(&buf, &len, &cap, JOURNAL_SPLICE, head, E.savetail, text, n);
+    free(text);
+    editorJournalReplace(buf, len, cap);
+}
+
+//距离空闲写盘还有多少毫秒，没有等待写盘的记录时返回-1
+int editorJournalTimeout()
+{
+    struct journalState *J = &E.journal;
+    if (J->fd == -1 || J->idle)
+        return -1;
+    long ms = editorElapsed(&J->last);
+    return ms >= KILO_JOURNAL_IDLE ? 0 : KILO_JOURNAL_IDLE - ms;
+}
+
+//等待时调用：空闲超过KILO_JOURNAL_IDLE毫秒后把记录写出并fsync，必要时压缩
+void editorJournalPoll()
+{
+    struct journalState *J = &E.journal;
+    if (editorJournalTimeout() != 0)
+        return;
+    J->idle = 1;
+    editorJournalCompact();
+    pthread_mutex_lock(&J->lock);
+    J->flush = 1;
+    pthread_cond_signal(&J->cond);
+    pthread_mutex_unlock(&J->lock);
+}
+
+//保存开始：之后的编辑同时记入since
+void editorJournalSaveBegin()
+{
+    struct journalState *J = &E.journal;
+    pthread_mutex_lock(&J->lock);
+    J->saving = 1;
+    J->sincelen = 0;
+    pthread_mutex_unlock(&J->lock);
+}
+
+//保存结束。成功时日志改以新文件为基础，只保留保存期间的编辑
+void editorJournalSaveEnd(int ok)
+{
+    struct journalState *J = &E.journal;
+    pthread_mutex_lock(&J->lock);
+    J->saving = 0;
+    pthread_mutex_unlock(&J->lock);
+    if (!ok || J->fd == -1)
+        return;
+    journalHeader h = journalBase();
+    size_t cap = sizeof(h) + J->sincelen;
+    char *buf = malloc(cap);
+    memcpy(buf, &h, sizeof(h));
+    if (J->sincelen)
+        memcpy(buf + sizeof(h), J->since, J->sincelen);
+    editorJournalReplace(buf, cap, cap);
+}
+
+//等待所有记录写入日志
+void editorJournalSync()
+{
+    struct journalState *J = &E.journal;
+    if (J->fd == -1 || !J->active)
+        return;
+    pthread_mutex_lock(&J->lock);
+    J->flush = 1;
+    pthread_cond_signal(&J->cond);
+    while (J->flush || J->busy)
+        pthread_cond_wait(&J->done, &J->lock);
+    pthread_mutex_unlock(&J->lock);
+}
+
+//退出前调用：有未保存的修改时把日志写完留给下次恢复，否则删除日志
+void editorJournalClose()
+{
+    struct journalState *J = &E.journal;
+    if (J->fd == -1)
+        return;
+    if (E.dirty)
+    {
+        editorJournalSync();
+        return;
+    }
+    unlink(J->path);
+}
+
+//解析日志，返回有效记录的个数，*end为最后一条完整记录之后的偏移
+int journalParse(const char *buf, size_t len, size_t *end)
+{
+    size_t off = sizeof(journalHeader);
+    int n = 0;
+    while (off + sizeof(journalRecord) + sizeof(unsigned) <= len)
+    {
+        journalRecord r;
+        memcpy(&r, buf + off, sizeof(r));
+        if (r.len < 0 || (size_t)r.len > len - off - sizeof(r) - sizeof(unsigned))
+            break;
+        unsigned sum;
+        memcpy(&sum, buf + off + sizeof(r) + r.len, sizeof(sum));
+        if (sum != journalSum(buf + off, sizeof(r) + r.len))
+            break;
+        off += sizeof(r) + r.len + sizeof(sum);
+        n++;
+    }
+    *end = off;
+    return n;
+}
+
+//按顺序重做日志中的n条记录，作为一步撤销
+void journalReplay(const char *buf, int n)
+{
+    size_t off = sizeof(journalHeader);
+    int i;
+    editorLoadAll();
+    editorUndoBeginGroup();
+    for (i = 0; i < n; i++)
+    {
+        journalRecord r;
+        memcpy(&r, buf + off, sizeof(r));
+        const char *s = buf + off + sizeof(r);
+        off += sizeof(r) + r.len + sizeof(unsigned);
+        if (r.type == JOURNAL_INSERT)
+        {
+            editorInsertText(r.a, r.b, s, r.len);
+        }
+        else if (r.type == JOURNAL_DELETE)
+        {
+            free(editorDeleteText(r.a, r.b, r.len, NULL));
+        }
+        else if (r.type == JOURNAL_REPLACE && r.len >= (int)sizeof(int))
+        {
+            int oldlen;
+            memcpy(&oldlen, s, sizeof(int));
+            editorReplaceText(r.a, r.b, oldlen, s + sizeof(int), r.len - sizeof(int));
+        }
+        else if (r.type == JOURNAL_SPLICE)
+        { //用记录的内容替换从偏移a开始、到末尾b字节之前的整行
+            long long total = E.rowroot ? E.rowroot->bytes : 0;
+            long long from = r.a, to = total - r.b;
+            int len = r.len;
+            char *text = malloc(len + 1);
+            memcpy(text, s, len);
+            if (to >= total && from > 0)
+            { //一直替换到末尾：连同上一行的换行一起替换，最后一行的换行保持不变
+                memmove(text + 1, text, len);
+                text[0] = '\n';
+                from--;
+                to--;
+            }
+            else if (to >= total)
+            {
+                to = to > 0 ? to - 1 : 0;
+                len = len > 0 ? len - 1 : 0;
+            }
+            int col;
+            int at = editorRowFromOffset(from, &col);
+            if (to > from)
+                free(editorDeleteText(at, col, to - from, NULL));
+            if (len)
+                editorInsertText(at, col, text, len);
+            free(text);
+        }
+    }
+    editorUndoEndGroup();
+}
+
+/*打开文件后检查日志：它基于的正是磁盘上的这个文件时，询问是否恢复其中的编辑。
+恢复后日志继续追加，否则删除它*/
+void editorJournalOpen()
+{
+    struct journalState *J = &E.journal;
+    journalSetPath();
+    int fd = open(J->path, O_RDONLY);
+    if (fd == -1)
+        return;
+    size_t len;
+    char *buf = editorReadFile(fd, &len);
+    close(fd);
+    journalHeader h = journalBase();
+    size_t end = 0;
+    int n = 0;
+    if (len >= sizeof(h) && memcmp(buf, KILO_JOURNAL_MAGIC, sizeof(h.magic)) == 0)
+        n = journalParse(buf, len, &end);
+    if (n > 0 && !(E.diskvalid && memcmp(buf, &h, sizeof(h)) == 0))
+    { //文件在日志之外被改过，日志不能再重做，留给用户处理
+        char *old = malloc(strlen(J->path) + 5);
+        sprintf(old, "%s.old", J->path);
+        rename(J->path, old);
+        editorSetStatusMessage("The file changed since the journal was written, moved it to %s", old);
+        free(old);
+        free(buf);
+        return;
+    }
+    if (n == 0)
+    {
+        unlink(J->path);
+        free(buf);
+        return;
+    }
+    J->recover = buf;
+    J->nrecover = n;
+    J->recoverend = end;
+    editorPrompt("Found unsaved changes in the journal. Recover? (y/n) %s", NULL,
+                 editorJournalRecover);
+}
+
+//回答是否恢复日志中的编辑
+void editorJournalRecover(char *answer)
+{
+    struct journalState *J = &E.journal;
+    char *buf = J->recover;
+    int n = J->nrecover;
+    size_t end = J->recoverend;
+    J->recover = NULL;
+    if (answer && (answer[0] == 'y' || answer[0] == 'Y'))
+    {
+        J->replaying = 1;
+        journalReplay(buf, n);
+        J->replaying = 0;
+        //去掉崩溃时写了一半的记录，之后的编辑接着追加
+        if (truncate(J->path, end) == 0)
+            J->fd = open(J->path, O_WRONLY | O_APPEND);
+        J->size = end;
+        if (J->fd != -1 && editorJournalStart() == -1)
+        {
+            close(J->fd);
+            J->fd = -1;
+        }
+        editorSetStatusMessage("Recovered %d changes from %s", n, J->path);
+    }
+    else
+    {
+        unlink(J->path);
+    }
+    free(answer);
+    free(buf);
+}
+
+/*** regex ***/
+/*正则表达式按Thompson构造编译成NFA，查找时由NFA惰性构造DFA：只在遇到新的(状态, 字节)时
+计算一次转移，之后查表，每个字节的代价是常数，不会因回溯而变慢。
+支持 . [] [^] * + ? | () ^ $ 以及 \d \w \s \D \W \S \t 和转义的字面字符。
+一行中的匹配为不重叠的最左最长匹配，空匹配被忽略*/
+
+#define RX_SET(cls, c) ((cls)[(unsigned char)(c) >> 3] |= 1 << ((unsigned char)(c) & 7))
+#define RX_HAS(cls, c) ((cls)[(unsigned char)(c) >> 3] & (1 << ((unsigned char)(c) & 7)))
+
+//添加一个NFA节点，返回其编号
+int regexAdd(regexNfa *nfa, int op, int out, int out1)
+{
+    if (nfa->n == nfa->cap)
+    {
+        nfa->cap = nfa->cap ? nfa->cap * 2 : 64;
+        nfa->node = realloc(nfa->node, sizeof(regexNode) * nfa->cap);
+    }
+    regexNode *x = &nfa->node[nfa->n];
+    x->op = op;
+    x->out = out;
+    x->out1 = out1;
+    memset(x->cls, 0, sizeof(x->cls));
+    return nfa->n++;
+}
+
+//只含一个节点的片段，出口是一个待连接的空转移
+regexFrag regexFragment(regexNfa *nfa, int op)
+{
+    int end = regexAdd(nfa, RX_JMP, -1, -1);
+    int start = regexAdd(nfa, op, end, -1);
+    return (regexFrag){start, end};
+}
+
+regexFrag regexConcat(regexNfa *nfa, regexFrag a, regexFrag b)
+{
+    nfa->node[a.end].out = b.start;
+    return (regexFrag){a.start, b.end};
+}
+
+regexFrag regexAlt(regexNfa *nfa, regexFrag a, regexFrag b)
+{
+    int end = regexAdd(nfa, RX_JMP, -1, -1);
+    int start = regexAdd(nfa, RX_SPLIT, a.start, b.start);
+    nfa->node[a.end].out = end;
+    nfa->node[b.end].out = end;
+    return (regexFrag){start, end};
+}
+
+//op为'*'、'+'或'?'
+regexFrag regexRepeat(regexNfa *nfa, regexFrag a, int op)
+{
+    int end = regexAdd(nfa, RX_JMP, -1, -1);
+    int split = regexAdd(nfa, RX_SPLIT, a.start, end);
+    nfa->node[a.end].out = op == '?' ? end : split;
+    return (regexFrag){op == '+' ? a.start : split, end};
+}
+
+//\d \w \s及其大写的取反形式加入字节集合，不是这些转义时返回0
+int regexClassEscape(unsigned char *cls, int c)
+{
+    unsigned char set[32] = {0};
+    int i;
+    switch (tolower(c))
+    {
+    case 'd':
+        for (i = '0'; i <= '9'; i++)
+            RX_SET(set, i);
+        break;
+    case 'w':
+        for (i = 0; i < 256; i++)
+            if (isalnum(i) || i == '_')
+                RX_SET(set, i);
+        break;
+    case 's':
+        for (i = 0; i < 256; i++)
+            if (isspace(i))
+                RX_SET(set, i);
+        break;
+    default:
+        return 0;
+    }
+    for (i = 0; i < 32; i++)
+        cls[i] |= isupper(c) ? ~set[i] : set[i];
+    return 1;
+}
+
+//转义的字面字符
+int regexEscape(int c)
+{
+    return c == 't' ? '\t' : c == 'n' ? '\n' : c == 'r' ? '\r' : c;
+}
+
+//解析[...]，P->p指向'['之后
+void regexParseClass(regexParser *P, unsigned char *cls)
+{
+    int neg = 0, first = 1, i;
+    if (P->p < P->end && *P->p == '^')
+    {
+        neg = 1;
+        P->p++;
+    }
+    while (P->p < P->end && (*P->p != ']' || first))
+    {
+        int lo = (unsigned char)*P->p++;
+        first = 0;
+        if (lo == '\\' && P->p < P->end)
+        {
+            lo = (unsigned char)*P->p++;
+            if (regexClassEscape(cls, lo))
+                continue;
+            lo = regexEscape(lo);
+        }
+        int hi = lo;
+        if (P->end - P->p >= 2 && P->p[0] == '-' && P->p[1] != ']')
+        {
+            hi = (unsigned char)P->p[1];
+            P->p += 2;
+            if (hi == '\\' && P->p < P->end)
+                hi = regexEscape((unsigned char)*P->p++);
+            if (hi < lo)
+            {
+                P->err = "bad range";
+                return;
+            }
+        }
+        for (i = lo; i <= hi; i++)
+            RX_SET(cls, i);
+    }
+    if (P->p >= P->end)
+    {
+        P->err = "missing ]";
+        return;
+    }
+    P->p++;
+    if (neg)
+        for (i = 0; i < 32; i++)
+            cls[i] = ~cls[i];
+}
+
+regexFrag regexParseAlt(regexParser *P);
+
+regexFrag regexParseAtom(regexParser *P)
+{
+    regexNfa *nfa = P->nfa;
+    int c = (unsigned char)*P->p++;
+    regexFrag f;
+    switch (c)
+    {
+    case '(':
+        f = regexParseAlt(P);
+        if (!P->err && (P->p >= P->end || *P->p != ')'))
+            P->err = "missing )";
+        if (!P->err)
+            P->p++;
+        return f;
+    case '^':
+    case '$':
+        //反向的NFA从行尾向前匹配，行首和行尾互换
+        return regexFragment(nfa, (c == '^') != P->rev ? RX_BOL : RX_EOL);
+    case '*':
+    case '+':
+    case '?':
+        P->err = "nothing to repeat";
+        return regexFragment(nfa, RX_JMP);
+    }
+    f = regexFragment(nfa, RX_CHAR);
+    unsigned char *cls = nfa->node[f.start].cls;
+    if (c == '.')
+    {
+        memset(cls, 0xff, 32);
+    }
+    else if (c == '[')
+    {
+        regexParseClass(P, cls);
+    }
+    else if (c == '\\')
+    {
+        if (P->p >= P->end)
+        {
+            P->err = "trailing \\";
+            return f;
+        }
+        c = (unsigned char)*P->p++;
+        if (!regexClassEscape(cls, c))
+            RX_SET(cls, regexEscape(c));
+    }
+    else
+    {
+        RX_SET(cls, c);
+    }
+    return f;
+}
+
+regexFrag regexParseRepeat(regexParser *P)
+{
+    regexFrag f = regexParseAtom(P);
+    while (!P->err && P->p < P->end && (*P->p == '*' || *P->p == '+' || *P->p == '?'))
+        f = regexRepeat(P->nfa, f, *P->p++);
+    return f;
+}
+
+//连接的各部分，反向的NFA中按相反的顺序连接
+regexFrag regexParseConcat(regexParser *P)
+{
+    regexFrag f = {-1, -1};
+    while (!P->err && P->p < P->end && *P->p != '|' && *P->p != ')')
+    {
+        regexFrag g = regexParseRepeat(P);
+        if (f.start == -1)
+            f = g;
+        else
+            f = P->rev ? regexConcat(P->nfa, g, f) : regexConcat(P->nfa, f, g);
+    }
+    if (f.start == -1)
+        f.start = f.end = regexAdd(P->nfa, RX_JMP, -1, -1);
+    return f;
+}
+
+regexFrag regexParseAlt(regexParser *P)
+{
+    regexFrag f = regexParseConcat(P);
+    while (!P->err && P->p < P->end && *P->p == '|')
+    {
+        P->p++;
+        f = regexAlt(P->nfa, f, regexParseConcat(P));
+    }
+    return f;
+}
+
+/*把表达式编译成NFA，rev为1时编译成匹配反转文本的NFA。
+成功返回NULL，否则返回错误说明*/
+const char *regexBuild(regexNfa *nfa, const char *p, int len, int rev)
+{
+    regexParser P = {p, p + len, nfa, rev, NULL};
+    regexFrag f = regexParseAlt(&P);
+    if (!P.err && P.p < P.end)
+        P.err = "unmatched )";
+    if (P.err)
+        return P.err;
+    int match = regexAdd(nfa, RX_MATCH, -1, -1);
+    nfa->node[f.end].out = match;
+    nfa->start = f.start;
+    //不锚定的起点：先跳过任意个字节
+    int any = regexAdd(nfa, RX_CHAR, -1, -1);
+    memset(nfa->node[any].cls, 0xff, 32);
+    nfa->ustart = regexAdd(nfa, RX_SPLIT, any, f.start);
+    nfa->node[any].out = nfa->ustart;
+    return NULL;
+}
+
+void dfaInit(regexDfa *d, const regexNfa *nfa, int root)
+{
+    memset(d, 0, sizeof(*d));
+    d->nfa = nfa;
+    d->root = root;
+    d->stack = malloc(sizeof(int) * nfa->n);
+    d->set = malloc(sizeof(int) * nfa->n);
+    d->tmp = malloc(sizeof(int) * nfa->n);
+    d->mark = calloc(nfa->n, sizeof(unsigned));
+    memset(d->hash, -1, sizeof(d->hash));
+    d->start[0] = d->start[1] = -1;
+}
+
+//丢弃所有DFA状态，缓存满时调用
+void dfaReset(regexDfa *d)
+{
+    int i;
+    for (i = 0; i < d->n; i++)
+        free(d->st[i].set);
+    d->n = 0;
+    d->resets++;
+    memset(d->hash, -1, sizeof(d->hash));
+    d->start[0] = d->start[1] = -1;
+}
+
+void dfaFree(regexDfa *d)
+{
+    dfaReset(d);
+    free(d->st);
+    free(d->trans);
+    free(d->flag);
+    free(d->stack);
+    free(d->set);
+    free(d->tmp);
+    free(d->mark);
+    d->st = NULL;
+    d->trans = NULL;
+    d->flag = NULL;
+    d->cap = 0;
+}
+
+//开始一次新的闭包计算，之前的标记作废
+void dfaMarkClear(regexDfa *d)
+{
+    if (++d->gen == 0)
+    {
+        memset(d->mark, 0, sizeof(unsigned) * d->nfa->n);
+        d->gen = 1;
+    }
+}
+
+/*从节点s出发经空转移能到达的、本次还没有标记的节点中，RX_CHAR、RX_MATCH和未通过的RX_EOL
+加入out。bol/eol表示当前位置在行首/行尾，行首行尾断言只在这时通过*/
+void dfaClosure(regexDfa *d, int s, int bol, int eol, int *out, int *n)
+{
+    const regexNode *node = d->nfa->node;
+    int top = 0;
+    if (d->mark[s] == d->gen)
+        return;
+    d->mark[s] = d->gen;
+    d->stack[top++] = s;
+    while (top)
+    {
+        int x = d->stack[--top];
+        int to[2], k = 0;
+        switch (node[x].op)
+        {
+        case RX_SPLIT:
+            to[k++] = node[x].out1;
+            //fallthrough
+        case RX_JMP:
+            to[k++] = node[x].out;
+            break;
+        case RX_BOL:
+            if (bol)
+                to[k++] = node[x].out;
+            break;
+        case RX_EOL:
+            if (eol)
+                to[k++] = node[x].out;
+            else
+                out[(*n)++] = x;
+            break;
+        default:
+            out[(*n)++] = x;
+        }
+        while (k--)
+            if (d->mark[to[k]] != d->gen)
+            {
+                d->mark[to[k]] = d->gen;
+                d->stack[top++] = to[k];
+            }
+    }
+}
+
+int dfaCompareInt(const void *a, const void *b)
+{
+    return *(const int *)a - *(const int *)b;
+}
+
+//查找d->set[0, n)对应的DFA状态，没有时新建（缓存满时先清空），返回状态编号
+int dfaFind(regexDfa *d, int n)
+{
+    const regexNode *node = d->nfa->node;
+    int i;
+    qsort(d->set, n, sizeof(int), dfaCompareInt);
+    unsigned h = 2166136261u;
+    for (i = 0; i < n; i++)
+        h = (h ^ d->set[i]) * 16777619u;
+    h %= KILO_REGEX_HASH;
+    for (i = d->hash[h]; i != -1; i = d->st[i].hnext)
+        if (d->st[i].nset == n && memcmp(d->st[i].set, d->set, sizeof(int) * n) == 0)
+            return i;
+
+    if (d->n == KILO_REGEX_STATES)
+        dfaReset(d);
+    if (d->n == d->cap)
+    {
+        d->cap = d->cap ? d->cap * 2 : 16;
+        d->st = realloc(d->st, sizeof(dfaState) * d->cap);
+        d->trans = realloc(d->trans, sizeof(int) * 256 * d->cap);
+        d->flag = realloc(d->flag, d->cap);
+    }
+    dfaState *st = &d->st[d->n];
+    st->set = malloc(sizeof(int) * (n ? n : 1));
+    memcpy(st->set, d->set, sizeof(int) * n);
+    st->nset = n;
+    int flag = n ? 0 : DFA_DEAD, eols = 0;
+    for (i = 0; i < n; i++)
+    {
+        if (node[st->set[i]].op == RX_MATCH)
+            flag |= DFA_ACCEPT | DFA_ACCEPTEND;
+        eols |= node[st->set[i]].op == RX_EOL;
+    }
+    //在行尾时，行尾断言之后还能不能到达匹配
+    if (!(flag & DFA_ACCEPT) && eols)
+    {
+        int m = 0;
+        dfaMarkClear(d);
+        for (i = 0; i < n; i++)
+            if (node[st->set[i]].op == RX_EOL)
+                dfaClosure(d, node[st->set[i]].out, 0, 1, d->tmp, &m);
+        for (i = 0; i < m; i++)
+            if (node[d->tmp[i]].op == RX_MATCH)
+                flag |= DFA_ACCEPTEND;
+    }
+    d->flag[d->n] = flag;
+    memset(&d->trans[d->n * 256], -1, sizeof(int) * 256);
+    st->hnext = d->hash[h];
+    d->hash[h] = d->n;
+    return d->n++;
+}
+
+//起始状态，bol表示从行首开始（反向的DFA为从行尾开始）
+int dfaStart(regexDfa *d, int bol)
+{
+    if (d->start[bol] == -1)
+    {
+        int n = 0;
+        dfaMarkClear(d);
+        dfaClosure(d, d->root, bol, 0, d->set, &n);
+        int s = dfaFind(d, n);
+        d->start[bol] = s;
+    }
+    return d->start[bol];
+}
+
+//计算状态s读入字节c后的状态
+int dfaStep(regexDfa *d, int s, unsigned char c)
+{
+    const regexNode *node = d->nfa->node;
+    int n = 0, i;
+    dfaMarkClear(d);
+    for (i = 0; i < d->st[s].nset; i++)
+    {
+        const regexNode *x = &node[d->st[s].set[i]];
+        if (x->op == RX_CHAR && RX_HAS(x->cls, c))
+            dfaClosure(d, x->out, 0, 0, d->set, &n);
+    }
+    int resets = d->resets;
+    int t = dfaFind(d, n);
+    //缓存被清空时s已经不存在
+    if (resets == d->resets)
+        d->trans[s * 256 + c] = t * 256;
+    return t;
+}
+
+//从s[from]开始的最长匹配的结束位置，没有匹配时返回-1
+int regexLongest(regexDfa *d, const char *s, int n, int from)
+{
+    int st = dfaStart(d, from == 0) * 256;
+    const int *trans = d->trans;
+    const unsigned char *flag = d->flag;
+    int last = flag[st >> 8] & DFA_ACCEPT ? from : -1;
+    int i;
+    for (i = from; i < n; i++)
+    {
+        int t = trans[st + (unsigned char)s[i]];
+        if (t < 0)
+        { //转移还没有计算，表可能被重新分配
+            t = dfaStep(d, st >> 8, s[i]) * 256;
+            trans = d->trans;
+            flag = d->flag;
+        }
+        st = t;
+        if (flag[st >> 8] & (DFA_ACCEPT | DFA_DEAD))
+        {
+            if (flag[st >> 8] & DFA_DEAD)
+                return last;
+            last = i + 1;
+        }
+    }
+    return flag[st >> 8] & DFA_ACCEPTEND ? n : last;
+}
+
+/*从行尾向前扫描一遍，从后到前记下所有匹配的起点。
+不在任何部分匹配中时，直接跳到前面最近的可能是匹配最后一个字节的位置，只有一种时用memrchr*/
+void regexStarts(const regex *re, regexCache *c, const char *s, int n)
+{
+    regexDfa *d = &c->rev;
+    int last = re->skip ? re->last : -1;
+    int st = dfaStart(d, 1) * 256;
+    int idle = re->skip ? dfaStart(d, 0) * 256 : -1;
+    int resets = d->resets;
+    const int *trans = d->trans;
+    const unsigned char *flag = d->flag;
+    int i;
+    c->nstarts = 0;
+    for (i = n - 1; i >= 0; i--)
+    {
+        if (st == idle)
+        {
+            if (last != -1)
+            {
+                const char *q = memrchr(s, last, i + 1);
+                i = q ? q - s : -1;
+            }
+            else
+            {
+                while (i >= 0 && !re->end[(unsigned char)s[i]])
+                    i--;
+            }
+            if (i < 0)
+                break;
+        }
+        int t = trans[st + (unsigned char)s[i]];
+        if (t < 0)
+        {
+            t = dfaStep(d, st >> 8, s[i]) * 256;
+            if (resets != d->resets && re->skip)
+            { //缓存被清空后状态重新编号
+                idle = dfaStart(d, 0) * 256;
+                resets = d->resets;
+            }
+            trans = d->trans;
+            flag = d->flag;
+        }
+        st = t;
+        if (flag[st >> 8] & (i ? DFA_ACCEPT : DFA_ACCEPTEND))
+        {
+            if (c->nstarts == c->startcap)
+            {
+                c->startcap = c->startcap ? c->startcap * 2 : 64;
+                c->starts = realloc(c->starts, sizeof(int) * c->startcap);
+            }
+            c->starts[c->nstarts++] = i;
+        }
+    }
+}
+
+void regexCacheFree(regexCache *c)
+{
+    if (c->id)
+    {
+        dfaFree(&c->fwd);
+        dfaFree(&c->rev);
+    }
+    free(c->starts);
+    memset(c, 0, sizeof(*c));
+}
+
+//求每个匹配共同的字面前缀，以及是否只能在行首匹配
+void regexAnalyze(regex *re)
+{
+    regexDfa d;
+    dfaInit(&d, &re->fwd, re->fwd.start);
+    const regexNode *node = re->fwd.node;
+    char buf[KILO_REGEX_PREFIX];
+    int len = 0, n = 0, s = re->fwd.start, bol = 1, i;
+    dfaMarkClear(&d);
+    dfaClosure(&d, s, 0, 0, d.set, &n);
+    re->bol = n == 0;
+    while (!re->bol && len < KILO_REGEX_PREFIX)
+    {
+        n = 0;
+        dfaMarkClear(&d);
+        dfaClosure(&d, s, bol, 0, d.set, &n);
+        if (n != 1 || node[d.set[0]].op != RX_CHAR)
+            break;
+        int c = -1;
+        for (i = 0; i < 256; i++)
+            if (RX_HAS(node[d.set[0]].cls, i))
+            {
+                if (c != -1)
+                    break;
+                c = i;
+            }
+        if (c == -1 || i < 256)
+            break;
+        buf[len++] = c;
+        s = node[d.set[0]].out;
+        bol = 0;
+    }
+    //前缀之后只剩匹配时，整个表达式就是这个字面串
+    n = 0;
+    dfaMarkClear(&d);
+    dfaClosure(&d, s, bol, 0, d.set, &n);
+    re->literal = len > 0 && n == 1 && node[d.set[0]].op == RX_MATCH;
+    searchCompile(&re->prefix, buf, len, 0);
+    dfaFree(&d);
+
+    //反向NFA起点能读入的字节就是匹配可能的最后一个字节
+    unsigned char cls[32] = {0};
+    dfaInit(&d, &re->rev, re->rev.start);
+    n = 0;
+    dfaMarkClear(&d);
+    dfaClosure(&d, re->rev.start, 0, 0, d.set, &n);
+    for (i = 0; i < n; i++)
+        if (re->rev.node[d.set[i]].op == RX_CHAR)
+        {
+            int k;
+            for (k = 0; k < 32; k++)
+                cls[k] |= re->rev.node[d.set[i]].cls[k];
+        }
+    n = 0;
+    for (i = 0; i < 256; i++)
+    {
+        re->end[i] = RX_HAS(cls, i) != 0;
+        if (re->end[i])
+        {
+            re->last = i;
+            n++;
+        }
+    }
+    if (n != 1)
+        re->last = -1;
+    re->skip = n <= KILO_REGEX_SKIP;
+    dfaFree(&d);
+}
+
+void regexFree(regex *re)
+{
+    free(re->fwd.node);
+    free(re->rev.node);
+    searchFree(&re->prefix);
+    free(re);
+}
+
+//编译正则表达式，有错误时返回NULL，*err为错误说明
+regex *regexCompile(const char *p, int len, const char **err)
+{
+    static int ids;
+    regex *re = calloc(1, sizeof(regex));
+    *err = regexBuild(&re->fwd, p, len, 0);
+    if (!*err)
+        *err = regexBuild(&re->rev, p, len, 1);
+    if (*err)
+    {
+        regexFree(re);
+        return NULL;
+    }
+    re->id = ++ids;
+    regexAnalyze(re);
+    return re;
+}
+
+/*查找s[0, n)中的全部匹配，追加到*m，c为调用线程自己的DFA缓存。
+有字面前缀时用searchNext找到前缀再从那里求最长匹配；否则先反向扫描一遍找出所有起点*/
+void regexRow(const regex *re, regexCache *c, const char *s, int n, int at,
+              searchMatch **m, int *cnt, int *cap)
+{
+    if (c->id != re->id)
+    {
+        regexCacheFree(c);
+        c->id = re->id;
+        dfaInit(&c->fwd, &re->fwd, re->fwd.start);
+        dfaInit(&c->rev, &re->rev, re->rev.ustart);
+    }
+    int from = 0, col, e, k;
+    if (re->bol)
+    {
+        e = regexLongest(&c->fwd, s, n, 0);
+        if (e > 0)
+            searchPush(m, cnt, cap, at, 0, e);
+        return;
+    }
+    if (re->prefix.len)
+    {
+        while ((col = searchNext(&re->prefix, s, n, from)) != -1)
+        {
+            e = re->literal ? col + re->prefix.len : regexLongest(&c->fwd, s, n, col);
+            if (e > col)
+            {
+                searchPush(m, cnt, cap, at, col, e - col);
+                from = e;
+            }
+            else
+            {
+                from = col + 1;
+            }
+        }
+        return;
+    }
+    regexStarts(re, c, s, n);
+    for (k = c->nstarts - 1; k >= 0; k--)
+    {
+        col = c->starts[k];
+        if (col < from)
+            continue;
+        e = regexLongest(&c->fwd, s, n, col);
+        if (e > col)
+        {
+            searchPush(m, cnt, cap, at, col, e - col);
+            from = e;
+        }
+    }
+}
+
+/*** find ***/
+/*预处理查找模式，regex为1时按正则表达式编译。
+表达式有错误时返回-1，sp->err为错误说明，这时查找没有匹配*/
+int searchCompile(searchPattern *sp, const char *p, int len, int regex)
+{
+    int i;
+    sp->regex = regex;
+    sp->re = NULL;
+    sp->err = NULL;
+    sp->p = malloc(len + 1);
+    memcpy(sp->p, p, len);
+    sp->p[len] = '\0';
+    sp->len = len;
+    for (i = 0; i < 256; i++)
+        sp->shift[i] = len;
+    for (i = 0; i < len - 1; i++)
+        sp->shift[(unsigned char)p[i]] = len - 1 - i;
+    if (regex && !(sp->re = regexCompile(p, len, &sp->err)))
+        return -1;
+    return 0;
+}
+
+void searchFree(searchPattern *sp)
+{
+    free(sp->p);
+    if (sp->re)
+        regexFree(sp->re);
+    sp->p = NULL;
+    sp->re = NULL;
+    sp->err = NULL;
+}
+
+/*在s[from, n)中查找模式，返回第一个匹配的位置，没有时返回-1。
+先用SIMD同时比较每个位置的首字节和尾字节筛选候选位置，再逐个验证；
+剩下不足一个向量的部分用Horspool查找*/
+int searchNext(const searchPattern *sp, const char *s, int n, int from)
+{
+    const char *p = sp->p;
+    int m = sp->len;
+    if (m == 0 || from < 0 || n - from < m)
+        return -1;
+    if (m == 1)
+    {
+        const char *q = memchr(s + from, p[0], n - from);
+        return q ? q - s : -1;
+    }
+    int i = from;
+#ifdef __SSE2__
+    __m128i first = _mm_set1_epi8(p[0]);
+    __m128i last = _mm_set1_epi8(p[m - 1]);
+    for (; i + m - 1 + 16 <= n; i += 16)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)(s + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(s + i + m - 1));
+        unsigned mask = _mm_movemask_epi8(
+            _mm_and_si128(_mm_cmpeq_epi8(a, first), _mm_cmpeq_epi8(b, last)));
+        while (mask)
+        {
+            int k = __builtin_ctz(mask);
+            if (memcmp(s + i + k + 1, p + 1, m - 2) == 0)
+                return i + k;
+            mask &= mask - 1;
+        }
+    }
+#endif
+    while (i + m <= n)
+    {
+        unsigned char c = s[i + m - 1];
+        if (c == (unsigned char)p[m - 1] && memcmp(s + i, p, m - 1) == 0)
+            return i;
+        i += sp->shift[c];
+    }
+    return -1;
+}
+
+/*工作线程池：扫描时把叶子按KILO_SEARCH_BLOCK分块，从光标所在块开始沿查找方向领取，
+每块的全部匹配单独保存。主线程只等待离光标最近的匹配所在的块，其余的块在后台继续扫描，
+全部完成后由editorSearchPoll并入匹配索引。
+工作线程只读取扫描开始时记下的叶子，修改行之前必须先调用editorSearchEditBegin*/
+
+//m中第一个位于(row, col)或之后的匹配的序号
+int searchLowerBound(searchMatch *m, int n, int row, int col)
+{
+    int lo = 0, hi = n;
+    while (lo < hi)
+    {
+        int mid = (lo + hi) / 2;
+        if (m[mid].row < row || (m[mid].row == row && m[mid].col < col))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+//第k个领取的块的编号
+int searchBlockOrder(int k)
+{
+    struct searchState *S = &E.search;
+    int b = (S->start + S->dir * k) % S->nblocks;
+    return b < 0 ? b + S->nblocks : b;
+}
+
+//把一个匹配追加到*m
+void searchPush(searchMatch **m, int *n, int *cap, int row, int col, int len)
+{
+    if (*n == *cap)
+    {
+        *cap = *cap ? *cap * 2 : 16;
+        *m = realloc(*m, sizeof(searchMatch) * *cap);
+    }
+    (*m)[(*n)++] = (searchMatch){row, col, len};
+}
+
+/*在一行中查找全部匹配，追加到*m。字面查找包括重叠的匹配，正则查找为不重叠的最左最长匹配。
+rc为调用线程自己的DFA缓存*/
+void searchRow(const searchPattern *sp, regexCache *rc, erow *row, int at,
+               searchMatch **m, int *n, int *cap)
+{
+    if (sp->err)
+        return;
+    if (sp->re)
+    {
+        regexRow(sp->re, rc, row->chars, row->size, at, m, n, cap);
+        return;
+    }
+    int col = searchNext(sp, row->chars, row->size, 0);
+    while (col != -1)
+    {
+        searchPush(m, n, cap, at, col, sp->len);
+        col = searchNext(sp, row->chars, row->size, col + 1);
+    }
+}
+
+//扫描第b块，任务被取消时提前返回
+void searchScanBlock(int b, int gen, regexCache *rc, searchMatch **out, int *outn)
+{
+    struct searchState *S = &E.search;
+    int n = 0, cap = 0;
+    searchMatch *m = NULL;
+    int l;
+    int end = (b + 1) * KILO_SEARCH_BLOCK;
+    if (end > S->nleaves)
+        end = S->nleaves;
+    for (l = b * KILO_SEARCH_BLOCK; l < end; l++)
+    {
+        if (__atomic_load_n(&S->gen, __ATOMIC_RELAXED) != gen)
+            break;
+        rowLeaf *leaf = S->leaves[l];
+        //第一片叶子中可能有一部分行已经在索引中
+        int i = S->from > S->leafstart[l] ? S->from - S->leafstart[l] : 0;
+        int start = S->leafstart[l];
+        //细化查找时，candend之前的行只逐个验证原来的匹配位置，不必遍历这些行
+        if (start + i < S->candend)
+        {
+            int end = start + leaf->h.n < S->candend ? start + leaf->h.n : S->candend;
+            int c = searchLowerBound(S->cand, S->ncand, start + i, 0);
+            for (; c < S->ncand && S->cand[c].row < end; c++)
+            {
+                erow row = rowGet(leaf, S->cand[c].row - start);
+                int col = S->cand[c].col;
+                if (col + S->sp.len <= row.size &&
+                    memcmp(&row.chars[col], S->sp.p, S->sp.len) == 0)
+                    searchPush(&m, &n, &cap, S->cand[c].row, col, S->sp.len);
+            }
+            i = end - start;
+        }
+        for (; i < leaf->h.n; i++)
+        {
+            erow row = rowGet(leaf, i);
+            searchRow(&S->sp, rc, &row, start + i, &m, &n, &cap);
+        }
+    }
+    *out = m;
+    *outn = n;
+}
+
+void *editorSearchWorker(void *arg)
+{
+    (void)arg;
+    struct searchState *S = &E.search;
+    regexCache rc = {0};
+    pthread_mutex_lock(&S->lock);
+    while (1)
+    {
+        if (S->next >= S->nblocks)
+        {
+            pthread_cond_wait(&S->work, &S->lock);
+            continue;
+        }
+        int b = searchBlockOrder(S->next++);
+        int gen = S->gen;
+        S->running++;
+        pthread_mutex_unlock(&S->lock);
+
+        searchMatch *m;
+        int n;
+        searchScanBlock(b, gen, &rc, &m, &n);
+
+        pthread_mutex_lock(&S->lock);
+        S->running--;
+        if (gen == S->gen)
+        {
+            S->block[b].m = m;
+            S->block[b].n = n;
+            S->block[b].done = 1;
+            S->ndone++;
+        }
+        else
+        {
+            free(m);
+        }
+        pthread_cond_broadcast(&S->done);
+        editorWake();
+    }
+    return NULL;
+}
+
+void editorSearchInit(int nthreads)
+{
+    pthread_mutex_init(&E.search.lock, NULL);
+    pthread_cond_init(&E.search.work, NULL);
+    pthread_cond_init(&E.search.done, NULL);
+    E.search.nthreads = nthreads;
+}
+
+//保证索引能再容纳n个匹配
+void searchReserve(int n)
+{
+    struct searchState *S = &E.search;
+    if (S->nmatch + n <= S->matchcap)
+        return;
+    while (S->nmatch + n > S->matchcap)
+        S->matchcap = S->matchcap ? S->matchcap * 2 : 256;
+    S->match = realloc(S->match, sizeof(searchMatch) * S->matchcap);
+}
+
+//第b块的第一行，以及最后一行的下一行
+int searchBlockFirst(int b)
+{
+    struct searchState *S = &E.search;
+    int row = S->leafstart[b * KILO_SEARCH_BLOCK];
+    return row > S->from ? row : S->from;
+}
+int searchBlockEnd(int b)
+{
+    struct searchState *S = &E.search;
+    return b + 1 < S->nblocks ? S->leafstart[(b + 1) * KILO_SEARCH_BLOCK] : S->numrows;
+}
+
+/*取消正在进行的扫描，等待工作线程都空闲下来。
+从第0块开始连续完成的块并入索引，其余的块丢弃，以后从新的from继续扫描*/
+void searchDropJob()
+{
+    struct searchState *S = &E.search;
+    if (!S->scanning)
+        return;
+    pthread_mutex_lock(&S->lock);
+    __atomic_store_n(&S->gen, S->gen + 1, __ATOMIC_RELAXED);
+    S->next = S->nblocks;
+    while (S->running)
+        pthread_cond_wait(&S->done, &S->lock);
+    pthread_mutex_unlock(&S->lock);
+
+    int b, from = S->from;
+    for (b = 0; b < S->nblocks && S->block[b].done; b++)
+    {
+        searchReserve(S->block[b].n);
+        if (S->block[b].n)
+            memcpy(&S->match[S->nmatch], S->block[b].m, sizeof(searchMatch) * S->block[b].n);
+        S->nmatch += S->block[b].n;
+        from = searchBlockEnd(b);
+    }
+    for (b = 0; b < S->nblocks; b++)
+        free(S->block[b].m);
+    free(S->block);
+    S->block = NULL;
+    S->from = from;
+    S->nleaves = 0;
+    S->scanning = 0;
+    if (S->cand && S->from >= S->candend)
+    { //候选都已验证
+        free(S->cand);
+        S->cand = NULL;
+        S->ncand = S->candend = 0;
+    }
+    pthread_mutex_lock(&S->lock);
+    S->nblocks = S->next = S->ndone = 0;
+    pthread_mutex_unlock(&S->lock);
+}
+
+//结束当前的查找，释放匹配索引
+void editorSearchClear()
+{
+    struct searchState *S = &E.search;
+    searchDropJob();
+    free(S->match);
+    free(S->cand);
+    free(S->leaves);
+    free(S->leafstart);
+    searchFree(&S->sp);
+    S->match = NULL;
+    S->cand = NULL;
+    S->ncand = S->candend = 0;
+    S->pending = 0;
+    S->leaves = NULL;
+    S->leafstart = NULL;
+    S->nmatch = S->matchcap = S->leafcap = S->from = S->numrows = 0;
+    S->active = 0;
+}
+
+//按顺序记下子树中包含第from行及以后各行的叶子
+void searchCollect(rowNode *node, int *row, int from)
+{
+    struct searchState *S = &E.search;
+    if (*row + node->rows <= from)
+    { //整棵子树都在from之前
+        *row += node->rows;
+        return;
+    }
+    if (node->leaf)
+    {
+        if (S->nleaves == S->leafcap)
+        {
+            S->leafcap = S->leafcap ? S->leafcap * 2 : 256;
+            S->leaves = realloc(S->leaves, sizeof(rowLeaf *) * S->leafcap);
+            S->leafstart = realloc(S->leafstart, sizeof(int) * S->leafcap);
+        }
+        S->leaves[S->nleaves] = (rowLeaf *)node;
+        S->leafstart[S->nleaves++] = *row;
+        *row += node->rows;
+        return;
+    }
+    int i;
+    for (i = 0; i < node->n; i++)
+        searchCollect(((rowInner *)node)->child[i], row, from);
+}
+
+//第row行所在的块
+int searchBlockOf(int row)
+{
+    struct searchState *S = &E.search;
+    int lo = 0, hi = S->nleaves - 1;
+    while (lo < hi)
+    {
+        int mid = (lo + hi + 1) / 2;
+        if (S->leafstart[mid] <= row)
+            lo = mid;
+        else
+            hi = mid - 1;
+    }
+    return lo / KILO_SEARCH_BLOCK;
+}
+
+//在后台扫描第from行以后已切分的行，从第row行所在的块开始沿dir方向领取
+void searchStartJob(int row, int dir)
+{
+    struct searchState *S = &E.search;
+    if (S->scanning || S->from >= E.numrows)
+        return;
+    if (S->tid == NULL)
+    { //第一次查找时创建线程池
+        int i;
+        S->tid = malloc(sizeof(pthread_t) * S->nthreads);
+        for (i = 0; i < S->nthreads; i++)
+            if (pthread_create(&S->tid[i], NULL, editorSearchWorker, NULL) != 0)
+                die("pthread_create");
+    }
+    int rows = 0;
+    S->nleaves = 0;
+    searchCollect(E.rowroot, &rows, S->from);
+    S->numrows = rows;
+    int nblocks = (S->nleaves + KILO_SEARCH_BLOCK - 1) / KILO_SEARCH_BLOCK;
+    S->block = calloc(nblocks, sizeof(searchBlock));
+    S->scanning = 1;
+    if (row < S->from)
+        row = S->from;
+    if (row >= rows)
+        row = rows - 1;
+
+    pthread_mutex_lock(&S->lock);
+    S->nblocks = nblocks;
+    S->ndone = 0;
+    S->lastdone = 0;
+    S->start = searchBlockOf(row);
+    S->dir = dir;
+    S->next = 0;
+    pthread_cond_broadcast(&S->work);
+    pthread_mutex_unlock(&S->lock);
+}
+
+/*在已切分的行中开始查找query，从第row行所在的块开始沿dir方向扫描。
+函数立即返回，结果由editorSearchNearest取得*/
+void editorSearchStart(const char *query, int len, int row, int dir)
+{
+    struct searchState *S = &E.search;
+    editorSearchClear();
+    if (len == 0)
+        return;
+    searchCompile(&S->sp, query, len, S->regex);
+    S->active = 1;
+    searchStartJob(row, dir);
+}
+
+/*查找串改为query。新的查找串以原来的查找串开头时，新的匹配一定在原来的匹配位置上，
+索引中的匹配和还没验证的候选都作为候选交给工作线程验证，还没有扫描的行再用新的模式扫描；
+否则（删除字符或改成别的串）重新查找。主线程只移动数组，不逐个验证。
+正则表达式加长后匹配不一定在原来的位置上，总是重新查找*/
+void editorSearchRefine(const char *query, int len, int row, int dir)
+{
+    struct searchState *S = &E.search;
+    if (S->active && S->sp.regex == S->regex && S->sp.len == len &&
+        memcmp(S->sp.p, query, len) == 0)
+        return;
+    if (!S->active || S->regex || S->sp.regex || len < S->sp.len ||
+        memcmp(S->sp.p, query, S->sp.len) != 0)
+    {
+        editorSearchStart(query, len, row, dir);
+        return;
+    }
+    //已完成的块并入索引
+    searchDropJob();
+    int c = searchLowerBound(S->cand, S->ncand, S->from, 0);
+    int rest = S->candend > S->from ? S->ncand - c : 0;
+    if (rest)
+    {
+        searchReserve(rest);
+        memcpy(&S->match[S->nmatch], &S->cand[c], sizeof(searchMatch) * rest);
+        S->nmatch += rest;
+    }
+    else
+    {
+        S->candend = S->from;
+    }
+    free(S->cand);
+    S->cand = S->match;
+    S->ncand = S->nmatch;
+    S->match = NULL;
+    S->nmatch = S->matchcap = S->from = 0;
+    searchFree(&S->sp);
+    searchCompile(&S->sp, query, len, 0);
+    searchStartJob(row, dir);
+}
+
+/*主线程定期调用：扫描全部完成时把结果并入索引；文件又切分出新的行时继续扫描。
+索引有变化时返回1*/
+int editorSearchPoll()
+{
+    struct searchState *S = &E.search;
+    if (!S->active)
+        return 0;
+    int changed = 0;
+    if (S->scanning)
+    {
+        pthread_mutex_lock(&S->lock);
+        int done = S->ndone;
+        pthread_mutex_unlock(&S->lock);
+        //有新完成的块时刷新，匹配个数和跳转逐步显示出来
+        if (done != S->lastdone)
+        {
+            S->lastdone = done;
+            changed = 1;
+        }
+        if (done == S->nblocks)
+            searchDropJob();
+    }
+    else
+    {
+        searchStartJob(S->from, 1);
+    }
+    if (S->pending && editorSearchJump(0))
+        changed = 1;
+    return changed;
+}
+
+//第b块是否已扫描完成，wait为1时等待它完成
+int searchBlockReady(int b, int wait)
+{
+    struct searchState *S = &E.search;
+    pthread_mutex_lock(&S->lock);
+    while (wait && !S->block[b].done)
+        pthread_cond_wait(&S->done, &S->lock);
+    int done = S->block[b].done;
+    pthread_mutex_unlock(&S->lock);
+    return done;
+}
+
+//等待已切分的行全部扫描完，结果并入索引
+void editorSearchFinish()
+{
+    struct searchState *S = &E.search;
+    while (S->active && (S->scanning || S->from < E.numrows))
+    {
+        searchStartJob(S->from, 1);
+        int b;
+        for (b = 0; b < S->nblocks; b++)
+            searchBlockReady(b, 1);
+        searchDropJob();
+    }
+}
+
+/*等待扫描完成，取走完整的匹配索引并结束查找。*n为匹配个数，返回的数组由调用者释放*/
+searchMatch *editorSearchTake(int *n)
+{
+    struct searchState *S = &E.search;
+    editorSearchFinish();
+    searchMatch *m = S->match;
+    *n = S->nmatch;
+    S->match = NULL;
+    S->nmatch = S->matchcap = 0;
+    editorSearchClear();
+    return m;
+}
+
+/*找到(row, col)之后（dir为-1时为之前）最近的匹配，到文件末尾后回绕。
+在索引中二分查找；正在扫描的部分只等待按查找方向排在这个匹配之前的块。
+找到返回1，没有匹配返回0；wait为0时不等待，需要的块还没完成时返回-1*/
+int editorSearchNearest(int row, int col, int dir, searchMatch *out, int wait)
+{
+    struct searchState *S = &E.search;
+    if (!S->active)
+        return 0;
+    //还有没扫描的行（修改或切分之后）时先开始扫描
+    searchStartJob(row, dir);
+    int b, i;
+    int nb = S->scanning ? S->nblocks : 0;
+    if (dir > 0)
+    {
+        i = searchLowerBound(S->match, S->nmatch, row, col + 1);
+        if (i < S->nmatch)
+        {
+            *out = S->match[i];
+            return 1;
+        }
+        for (b = 0; b < nb; b++)
+        {
+            if (searchBlockEnd(b) <= row)
+                continue;
+            if (!searchBlockReady(b, wait))
+                return -1;
+            i = searchLowerBound(S->block[b].m, S->block[b].n, row, col + 1);
+            if (i < S->block[b].n)
+            {
+                *out = S->block[b].m[i];
+                return 1;
+            }
+        }
+        //回绕到文件开头
+        if (S->nmatch)
+        {
+            *out = S->match[0];
+            return 1;
+        }
+        for (b = 0; b < nb; b++)
+        {
+            if (!searchBlockReady(b, wait))
+                return -1;
+            if (S->block[b].n)
+            {
+                *out = S->block[b].m[0];
+                return 1;
+            }
+        }
+    }
+    else
+    {
+        for (b = nb - 1; b >= 0; b--)
+        {
+            if (searchBlockFirst(b) > row)
+                continue;
+            if (!searchBlockReady(b, wait))
+                return -1;
+            i = searchLowerBound(S->block[b].m, S->block[b].n, row, col) - 1;
+            if (i >= 0)
+            {
+                *out = S->block[b].m[i];
+                return 1;
+            }
+        }
+        i = searchLowerBound(S->match, S->nmatch, row, col) - 1;
+        if (i >= 0)
+        {
+            *out = S->match[i];
+            return 1;
+        }
+        //回绕到文件末尾
+        for (b = nb - 1; b >= 0; b--)
+        {
+            if (!searchBlockReady(b, wait))
+                return -1;
+            if (S->block[b].n)
+            {
+                *out = S->block[b].m[S->block[b].n - 1];
+                return 1;
+            }
+        }
+        if (S->nmatch)
+        {
+            *out = S->match[S->nmatch - 1];
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/*返回已知的匹配个数，还有行没有扫描时*complete为0。
+(row, col)处是匹配且序号已知时*index为它的序号（从1开始），否则为0*/
+int editorSearchCount(int row, int col, int *index, int *complete)
+{
+    struct searchState *S = &E.search;
+    int total = S->nmatch;
+    int known = 1; //之前的块都已完成，序号可以确定
+    int b, i;
+    *index = 0;
+    i = searchLowerBound(S->match, S->nmatch, row, col);
+    if (i < S->nmatch && S->match[i].row == row && S->match[i].col == col)
+        *index = i + 1;
+    pthread_mutex_lock(&S->lock);
+    for (b = 0; b < S->nblocks; b++)
+    {
+        searchBlock *blk = &S->block[b];
+        if (!blk->done)
+        {
+            known = 0;
+            continue;
+        }
+        if (known && *index == 0)
+        {
+            i = searchLowerBound(blk->m, blk->n, row, col);
+            if (i < blk->n && blk->m[i].row == row && blk->m[i].col == col)
+                *index = total + i + 1;
+        }
+        total += blk->n;
+    }
+    pthread_mutex_unlock(&S->lock);
+    *complete = !S->scanning && S->from >= E.numrows && editorLoaded();
+    return total;
+}
+
+/*第at行在匹配索引中的全部匹配：*m指向其中按列排序的第一个，返回个数。
+这一行还没有扫描（在from之后，所在的块还没有完成）时返回-1*/
+int editorSearchRowMatches(int at, searchMatch **m)
+{
+    struct searchState *S = &E.search;
+    searchMatch *v = S->match;
+    int n = S->nmatch;
+    if (at >= S->from)
+    {
+        if (!S->scanning || at >= S->numrows)
+            return -1;
+        int b = searchBlockOf(at);
+        if (at < searchBlockFirst(b) || !searchBlockReady(b, 0))
+            return -1;
+        v = S->block[b].m;
+        n = S->block[b].n;
+    }
+    int lo = searchLowerBound(v, n, at, 0);
+    *m = &v[lo];
+    return searchLowerBound(v, n, at + 1, 0) - lo;
+}
+
+/*跳转到等待中的匹配，wait为0时不等待工作线程。结果已经确定（跳转或没有匹配）时返回1*/
+int editorSearchJump(int wait)
+{
+    struct searchState *S = &E.search;
+    searchMatch m;
+    int found = editorSearchNearest(S->prow, S->pcol, S->pdir, &m, wait);
+    if (found == -1)
+        return 0;
+    S->pending = 0;
+    if (found)
+    {
+        E.cy = m.row;
+        E.cx = m.col;
+        E.rowoff = E.numrows;
+    }
+    return 1;
+}
+
+//修改行之前调用：停止扫描，工作线程不再读取行
+void editorSearchEditBegin()
+{
+    searchDropJob();
+}
+
+/*修改行之后调用：原来从第at行开始的oldrows行变成了newrows行。
+只重新扫描这些行并移动其后各匹配的行号，还没有扫描的行留给editorSearchPoll*/
+void editorSearchEditEnd(int at, int oldrows, int newrows)
+{
+    struct searchState *S = &E.search;
+    if (!S->active)
+        return;
+    int i;
+    if (S->cand)
+    { //候选都在from之后：修改在from之前时随之移动行号，否则放弃候选，这些行重新完整扫描
+        if (at + oldrows <= S->from)
+        {
+            for (i = 0; i < S->ncand; i++)
+                S->cand[i].row += newrows - oldrows;
+            S->candend += newrows - oldrows;
+        }
+        else
+        {
+            free(S->cand);
+            S->cand = NULL;
+            S->ncand = S->candend = 0;
+        }
+    }
+    if (at >= S->from)
+        return;
+    int lo = searchLowerBound(S->match, S->nmatch, at, 0);
+    if (at + oldrows > S->from)
+    { //修改跨过了已扫描部分的末尾，从at开始重新扫描
+        S->nmatch = lo;
+        S->from = at;
+        return;
+    }
+    int hi = searchLowerBound(S->match, S->nmatch, at + oldrows, 0);
+    int n = 0, cap = 0;
+    searchMatch *m = NULL;
+    for (i = at; i < at + newrows; i++)
+    {
+        erow row = editorRow(i);
+        searchRow(&S->sp, &S->rc, &row, i, &m, &n, &cap);
+    }
+    int tail = S->nmatch - hi;
+    S->nmatch = lo;
+    searchReserve(n + tail);
+    if (tail)
+        memmove(&S->match[lo + n], &S->match[hi], sizeof(searchMatch) * tail);
+    if (n)
+        memcpy(&S->match[lo], m, sizeof(searchMatch) * n);
+    S->nmatch = lo + n + tail;
+    int delta = newrows - oldrows;
+    if (delta)
+        for (i = lo + n; i < S->nmatch; i++)
+            S->match[i].row += delta;
+    S->from += delta;
+    free(m);
+}
+
+//查找输入框的提示：字面或正则查找，正则表达式有错误时显示错误
+const char *editorFindPrompt()
+{
+    static char fmt[80];
+    struct searchState *S = &E.search;
+    if (!S->regex)
+        return "Search: %s (ESC/Arrows/Enter, Ctrl-E regex)";
+    if (S->active && S->sp.err)
+    {
+        snprintf(fmt, sizeof(fmt), "Regex: %%s (%s)", S->sp.err);
+        return fmt;
+    }
+    return "Regex: %s (ESC/Arrows/Enter, Ctrl-E literal)";
+}
+
+/*定义回调函数用于增量查找，对每一种按键都作相应操作。
+查找在后台进行，回调不等待结果：记下要跳转的位置，结果确定后由editorSearchPoll跳转，
+新的按键到来时旧的扫描被取消*/
+void editorFindCallback(char *query, int key)
+{
+    struct searchState *S = &E.search;
+    //取消查找时去掉匹配的高亮，确认后保留
+    if (key == '\x1b')
+    {
+        editorSearchClear();
+        return;
+    }
+    else if (key == '\r')
+    {
+        return;
+    }
+
+    //Ctrl-E切换字面和正则表达式，按新的模式重新查找
+    if (key == CTRL_KEY('e'))
+        S->regex = !S->regex;
+    //方向键控制搜索方向
+    if (key == ARROW_RIGHT || key == ARROW_DOWN || key == ARROW_LEFT || key == ARROW_UP)
+    { //从上一个匹配继续找，上一次跳转还没确定时先等它
+        if (S->pending)
+            editorSearchJump(1);
+        S->prow = E.cy;
+        S->pcol = E.cx;
+        S->pdir = (key == ARROW_RIGHT || key == ARROW_DOWN) ? 1 : -1;
+    }
+    else
+    { //查找串变了，从文件开头重新查找，在原来的查找串后面输入时只验证原来的匹配
+        //文件仍在后台切分时，先在已切分的部分中查找，其余的行切分后继续扫描
+        editorSearchRefine(query, strlen(query), 0, 1);
+        E.prompt.fmt = editorFindPrompt();
+        S->prow = 0;
+        S->pcol = -1;
+        S->pdir = 1;
+    }
+    S->pending = 1;
+    editorSearchJump(0);
+}
+
+//结束查找，取消时光标回到进入search模式前的位置
+void editorFindDone(char *query)
+{
+    if (query)
+    {
+        free(query);
+    }
+    else
+    {
+        E.cx = E.prompt.cx;
+        E.cy = E.prompt.cy;
+        E.coloff = E.prompt.coloff;
+        E.rowoff = E.prompt.rowoff;
+    }
+}
+
+void editorFind()
+{ //editorFindCallback作editorPrompt的回调函数（函数作参数）
+    editorPrompt(editorFindPrompt(), editorFindCallback, editorFindDone);
+}
+
+//跳转到输入的行，以@开头时按文件中的字节偏移跳转
+void editorGotoDone(char *query)
+{
+    if (query == NULL)
+        return;
+    if (query[0] == '@')
+    { //偏移之前的部分也要切分完才能知道目标的行号
+        long long off = atoll(&query[1]);
+        while (!editorLoaded() && (E.rowroot == NULL || E.rowroot->bytes <= off))
+            editorLoadRows(E.numrows + 65536);
+        E.cy = editorRowFromOffset(off, &E.cx);
+    }
+    else
+    {
+        editorLoadRows(atoi(query) + 1);
+        E.cy = atoi(query) - 1;
+        if (E.cy < 0)
+            E.cy = 0;
+        if (E.cy > E.numrows)
+            E.cy = E.numrows;
+        E.cx = 0;
+    }
+    //让目标行出现在窗口中间
+    E.rowoff = E.cy - E.screenrows / 2;
+    if (E.rowoff < 0)
+        E.rowoff = 0;
+    free(query);
+}
+
+void editorGoto()
+{
+    editorPrompt("Go to line: %s (@offset for byte offset)", NULL, editorGotoDone);
+}
+
+/*** replace***/
+/*把行中的匹配m[0, n)换成rep：只生成从第一个匹配到最后一个匹配末尾这一段替换后的内容，
+写到*buf中（容量*cap不够时扩大，在各行之间复用）。*col和*oldlen为被换掉的一段，
+*count为替换的个数，返回新内容的长度。与前一个匹配重叠的匹配跳过*/
+int replaceMatches(erow *row, const searchMatch *m, int n, const char *rep, char **buf,
+                   int *cap, int *col, int *oldlen, int *count)
+{
+    int rlen = strlen(rep);
+    int start = m[0].col, end = start, size = 0, i;
+    *count = 0;
+    for (i = 0; i < n; i++)
+        if (m[i].col >= end)
+        {
+            size += m[i].col - end + rlen;
+            end = m[i].col + m[i].len;
+            (*count)++;
+        }
+    if (*buf == NULL || size > *cap)
+    {
+        *cap = size > *cap * 2 ? size : *cap * 2 + 16;
+        *buf = realloc(*buf, *cap);
+    }
+    char *q = *buf;
+    end = start;
+    for (i = 0; i < n; i++)
+    {
+        if (m[i].col < end)
+            continue;
+        memcpy(q, &row->chars[end], m[i].col - end);
+        q += m[i].col - end;
+        memcpy(q, rep, rlen);
+        q += rlen;
+        end = m[i].col + m[i].len;
+    }
+    *col = start;
+    *oldlen = end - start;
+    return size;
+}
+
+//替换输入框的回调：Ctrl-E切换字面和正则表达式
+void editorReplaceCallback(char *query, int key)
+{
+    (void)query;
+    if (key == CTRL_KEY('e'))
+        E.search.regex = !E.search.regex;
+    E.prompt.fmt = E.search.regex ? "Regex: %s (ESC to cancel, Ctrl-E literal)"
+                                  : "Search: %s (ESC to cancel, Ctrl-E regex)";
+}
+
+/*把按位置排序的匹配m[0, n)全部换成rep，一遍处理完所有有匹配的行，整个替换作为一步撤销。
+每行只把第一个到最后一个匹配之间的一段原地换掉，撤销和日志也只记这一段。
+返回替换的个数，*rows为修改的行数*/
+int editorReplaceAll(const searchMatch *m, int n, const char *rep, int *rows)
+{
+    int i = 0, count = 0;
+    char *buf = NULL;
+    int cap = 0;
+    *rows = 0;
+    editorUndoBeginGroup();
+    while (i < n)
+    {
+        int at = m[i].row, k = i, col, oldlen, len, c;
+        while (k < n && m[k].row == at)
+            k++;
+        erow row = editorRow(at);
+        len = replaceMatches(&row, &m[i], k - i, rep, &buf, &cap, &col, &oldlen, &c);
+        editorReplaceText(at, col, oldlen, buf, len);
+        count += c;
+        (*rows)++;
+        i = k;
+    }
+    editorUndoEndGroup();
+    free(buf);
+    return count;
+}
+
+//输入替换串后全部替换
+void editorReplaceDone(char *replace)
+{
+    if (replace == NULL)
+    {
+        editorSearchClear();
+        return;
+    }
+    int n, rows;
+    searchMatch *m = editorSearchTake(&n);
+    int count = editorReplaceAll(m, n, replace, &rows);
+    editorSetStatusMessage("Replaced %d matches on %d lines", count, rows);
+    free(m);
+    free(replace);
+}
+
+//输入查找串后找出全部匹配，再询问替换串
+void editorReplaceQuery(char *query)
+{
+    struct searchState *S = &E.search;
+    if (query == NULL)
+        return;
+    editorLoadAll();
+    editorSearchStart(query, strlen(query), 0, 1);
+    free(query);
+    if (S->sp.err)
+    {
+        editorSetStatusMessage("Bad regex: %s", S->sp.err);
+        editorSearchClear();
+        return;
+    }
+    searchMatch first;
+    if (!editorSearchNearest(0, -1, 1, &first, 1))
+    {
+        editorSetStatusMessage("No match");
+        editorSearchClear();
+        return;
+    }
+    E.cy = first.row;
+    E.cx = first.col;
+    E.rowoff = E.numrows;
+    editorPrompt("Replace all with: %s (ESC to cancel)", NULL, editorReplaceDone);
+}
+
+/*替换函数：用查找线程池找出全部匹配，输入替换串时高亮显示所有匹配，
+确认后全部替换*/
+void editorReplace()
+{
+    editorPrompt(E.search.regex ? "Regex: %s (ESC to cancel, Ctrl-E literal)"
+                                : "Search: %s (ESC to cancel, Ctrl-E regex)",
+                 editorReplaceCallback, editorReplaceQuery);
+}
+
+/*** append buffer ***/
+//添加一段输出
+void abPushSeg(struct abuf *ab, const char *p, int off, int len)
+{
+    if (ab->nseg == ab->segcap)
+    {
+        ab->segcap = ab->segcap ? ab->segcap * 2 : 64;
+        ab->seg = realloc(ab->seg, sizeof(abSeg) * ab->segcap);
+    }
+    ab->seg[ab->nseg++] = (abSeg){p, off, len};
+}
+
+//对可追加缓冲区进行追加，缓冲区按倍数增长
+void abAppend(struct abuf *ab, const char *s, int len)
+{
+    if (len <= 0)
+        return;
+    if (ab->len + len > ab->cap)
+    {
+        int cap = ab->cap ? ab->cap : 4096;
+        while (cap < ab->len + len)
+            cap *= 2;
+        char *new = realloc(ab->b, cap);
+        if (new == NULL)
+            return;
+        ab->b = new;
+        ab->cap = cap;
+    }
+    //从追加位置开始拷贝
+    memcpy(&ab->b[ab->len], s, len);
+    //紧接着上一段复制的内容时合并为一段
+    abSeg *last = ab->nseg ? &ab->seg[ab->nseg - 1] : NULL;
+    if (last && last->p == NULL && last->off + last->len == ab->len)
+        last->len += len;
+    else
+        abPushSeg(ab, NULL, ab->len, len);
+    ab->len += len;
+}
+
+//追加对s的引用而不复制，s在输出之前必须保持有效
+void abAppendRef(struct abuf *ab, const char *s, int len)
+{
+    if (len > 0)
+        abPushSeg(ab, s, 0, len);
+}
+
+//清空缓冲区，保留已分配的内存
+void abReset(struct abuf *ab)
+{
+    ab->len = 0;
+    ab->nseg = 0;
+}
+
+/*用writev把缓冲区的各段写到fd，处理部分写入和EINTR，返回写出的字节数，出错返回-1。
+写完后清空缓冲区*/
+long long abFlush(struct abuf *ab, int fd)
+{
+    struct iovec iov[64];
+    long long total = 0;
+    int seg = 0;
+    int skip = 0; //第seg段中已经写出的字节数
+    while (seg < ab->nseg)
+    {
+        int n = 0;
+        int i;
+        for (i = seg; i < ab->nseg && n < 64; i++, n++)
+        {
+            abSeg *sg = &ab->seg[i];
+            const char *base = sg->p ? sg->p : ab->b + sg->off;
+            int from = i == seg ? skip : 0;
+            iov[n].iov_base = (char *)base + from;
+            iov[n].iov_len = sg->len - from;
+        }
+        ssize_t w = writev(fd, iov, n);
+        if (w == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN)
+            { //非阻塞终端暂时写不进去，等待可写
+                struct pollfd pfd = {fd, POLLOUT, 0};
+                poll(&pfd, 1, -1);
+                continue;
+            }
+            abReset(ab);
+            return -1;
+        }
+        total += w;
+        //跳过已经完整写出的段
+        while (w > 0)
+        {
+            int left = ab->seg[seg].len - skip;
+            if (w >= left)
+            {
+                w -= left;
+                seg++;
+                skip = 0;
+            }
+            else
+            {
+                skip += w;
+                w = 0;
+            }
+        }
+    }
+    abReset(ab);
+    return total;
+}
+
+void abFree(struct abuf *ab)
+{
+    free(ab->b);
+    free(ab->seg);
+}
+
+/*** output ***/
+/*我们的策略是检查光标是否移到了可见窗口之外，如果是，调整E.rowoff，使光标正好位于可见窗口内。*/
+
+void editorScroll()
+{
+    //光标所在行及下一行必须已经切分出来
+    editorLoadRows(E.cy + 2);
+    E.rx = 0;
+    if (E.cy < E.numrows)
+    {
+        E.rx = editorRowCxToRx(E.cy, E.cx);
+    }
+    //当光标小于偏移量时，E.rowoff = E.cy，显示时的坐标为 E.cy-E.rowoff=1
+
+    if (E.cy < E.rowoff)
+    {
+        E.rowoff = E.cy;
+    }
+    /*当光标超过偏移量+显示范围，就让E.rowoff = E.cy - E.screenrows + 1
+  显示时坐标为E.y-E.rowoff=E.screenrows
+  */
+    if (E.cy >= E.rowoff + E.screenrows)
+    {
+        E.rowoff = E.cy - E.screenrows + 1;
+    }
+    //窗口中可见的行在绘制前切分出来
+    editorLoadRows(E.rowoff + E.screenrows + 1);
+    if (E.rx < E.coloff)
+    {
+        E.coloff = E.rx;
+    }
+    if (E.rx >= E.coloff + E.screencols)
+    {
+        E.coloff = E.rx - E.screencols + 1;
+    }
+}
+//丢弃上一帧的内容，下一次刷新时整屏重绘
+void editorFrameInvalidate()
+{
+    E.frame.valid = 0;
+}
+
+/*s的len个字节显示时占的列数，高亮等转义序列（ESC [ 参数 结束字符）不占列。
+含非ASCII字节时返回-1：中文等宽字符占两列，按字节或字符都数不准*/
+int editorLineCols(const char *s, int len)
+{
+    int cols = 0;
+    int i;
+    for (i = 0; i < len; i++)
+    {
+        if (s[i] == '\x1b' && i + 1 < len && s[i + 1] == '[')
+        {
+            for (i += 2; i < len && (s[i] < 0x40 || s[i] > 0x7E); i++)
+                ;
+            continue;
+        }
+        if (s[i] & 0x80)
+            return -1;
+        cols++;
+    }
+    return cols;
+}
+
+/*把屏幕第y行的新内容与上一帧比较，只输出变化的部分。
+plain为1表示行内没有转义序列，此时新旧两行都只含ASCII字符时跳过相同的前缀，
+从第一个不同的字符开始输出；含非ASCII字符的行从行首整行重绘*/
+void editorFlushLine(struct abuf *ab, int y, const char *s, int len, int plain)
+{
+    screenLine *old = &E.frame.line[y];
+    if (E.frame.valid && old->len == len && memcmp(old->b, s, len) == 0)
+        return;
+    int cols = editorLineCols(s, len);
+    int from = 0;
+    if (E.frame.valid && plain && cols >= 0 && old->cols >= 0)
+    {
+        while (from < len && from < old->len && s[from] == old->b[from])
+            from++;
+    }
+    char buf[32];
+    int buflen = snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, from + 1);
+    abAppend(ab, buf, buflen);
+    /*新内容显示的列数比旧内容少时清除光标右端至结尾。按列而不是字节比较：
+    带高亮的行转义序列不占列。列数不确定（含非ASCII字符）时总是清除*/
+    int clear = !E.frame.valid || cols < 0 || old->cols < 0 || old->cols > cols;
+    //记下这一行的新内容，输出时直接引用这份副本，不再复制
+    if (old->cap < len)
+    {
+        old->cap = len * 2;
+        old->b = realloc(old->b, old->cap);
+    }
+    if (len)
+        memcpy(old->b, s, len);
+    old->len = len;
+    old->cols = cols;
+    abAppendRef(ab, old->b + from, len - from);
+    if (clear)
+        abAppend(ab, "\x1b[K", 3);
+}
+
+/*窗口上下滚动不超过半屏时，用终端的滚动区域移动已有的行，
+上一帧的内容随之移动，只有新露出的行需要输出*/
+void editorScrollFrame(struct abuf *ab, int d)
+{
+    char buf[32];
+    int buflen = snprintf(buf, sizeof(buf), "\x1b[1;%dr", E.screenrows);
+    abAppend(ab, buf, buflen);
+    int n = d > 0 ? d : -d;
+    int i;
+    if (d > 0)
+    { //在滚动区域底部换行，内容上移
+        buflen = snprintf(buf, sizeof(buf), "\x1b[%d;1H", E.screenrows);
+        abAppend(ab, buf, buflen);
+        for (i = 0; i < n; i++)
+            abAppend(ab, "\n", 1);
+    }
+    else
+    { //在滚动区域顶部反向换行，内容下移
+        abAppend(ab, "\x1b[H", 3);
+        for (i = 0; i < n; i++)
+            abAppend(ab, "\x1bM", 2);
+    }
+    //恢复滚动区域为整个屏幕
+    abAppend(ab, "\x1b[r", 3);
+
+    //上一帧的行随之移动，新露出的行为空
+    screenLine *line = E.frame.line;
+    screenLine tmp[n];
+    if (d > 0)
+    {
+        memcpy(tmp, line, sizeof(screenLine) * n);
+        memmove(line, line + n, sizeof(screenLine) * (E.screenrows - n));
+        memcpy(line + E.screenrows - n, tmp, sizeof(screenLine) * n);
+        for (i = E.screenrows - n; i < E.screenrows; i++)
+            line[i].len = line[i].cols = 0;
+    }
+    else
+    {
+        memcpy(tmp, line + E.screenrows - n, sizeof(screenLine) * n);
+        memmove(line + n, line, sizeof(screenLine) * (E.screenrows - n));
+        memcpy(line, tmp, sizeof(screenLine) * n);
+        for (i = 0; i < n; i++)
+            line[i].len = line[i].cols = 0;
+    }
+}
+
+/*把第at行可见的部分（渲染的[coloff, coloff+len)）连同查找匹配的高亮写到line，
+行内没有可见的匹配时返回0*/
+int editorDrawMatches(struct abuf *line, int at, const char *render, int len)
+{
+    static searchMatch *buf;
+    static int cap;
+    searchMatch *m;
+    int start = E.coloff, end = E.coloff + len;
+    int pos = start; //已输出到的渲染位置
+    int found = 0;
+    int i = 0;
+    int n = editorSearchRowMatches(at, &m);
+    if (n == -1)
+    { //这一行还没有扫描到（刚切分出来或正在扫描的块未完成），先单独查找这一行
+        erow row = editorRow(at);
+        n = 0;
+        searchRow(&E.search.sp, &E.search.rc, &row, at, &buf, &n, &cap);
+        m = buf;
+    }
+    abReset(line);
+    while (i < n)
+    {
+        int r0 = editorRowCxToRx(at, m[i].col);
+        //重叠的匹配合并为一段
+        int e = m[i].col + m[i].len;
+        for (i++; i < n && m[i].col < e; i++)
+            if (m[i].col + m[i].len > e)
+                e = m[i].col + m[i].len;
+        int r1 = editorRowCxToRx(at, e);
+        if (r0 < pos)
+            r0 = pos;
+        if (r1 > end)
+            r1 = end;
+        if (r0 >= r1)
+            continue;
+        abAppend(line, &render[pos], r0 - pos);
+        abAppend(line, "\x1b[7m", 4);
+        abAppend(line, &render[r0], r1 - r0);
+        abAppend(line, "\x1b[27m", 5);
+        pos = r1;
+        found = 1;
+    }
+    if (!found)
+        return 0;
+    abAppend(line, &render[pos], end - pos);
+    return 1;
+}
+
+//按行绘制
+void editorDrawRows(struct abuf *ab)
+{
+    struct abuf line = ABUF_INIT;
+    int y;
+    //显示小于窗口的行数的内容
+    for (y = 0; y < E.screenrows; y++)
+    { /*相当于从E.row[rowoff]的位置开始显示
+    */
+        int filerow = y + E.rowoff;
+        abReset(&line);
+        //对于大于文件行数的行，行首打印'~'
+        if (filerow >= E.numrows)
+        {
+            //在不加载文件的条件下，打印欢迎信息，首先使欢迎信息行定位
+
+            if (E.numrows == 0 && y == E.screenrows / 3)
+            {
+                char welcome[80];
+                int welcomelen = snprintf(welcome, sizeof(welcome),
+                                          "miword -- version %s", KILO_VERSION);
+                //窗口不够宽，截断欢迎信息
+                if (welcomelen > E.screencols)
+                    welcomelen = E.screencols;
+                //使欢迎信息列居中
+                int padding = (E.screencols - welcomelen) / 2;
+                if (padding)
+                {
+                    abAppend(&line, "~", 1);
+                    padding--;
+                }
+                while (padding--)
+                    abAppend(&line, " ", 1);
+                abAppend(&line, welcome, welcomelen);
+            }
+            else
+            { //打印文件,从列偏移的位置开始打印每行
+                abAppend(&line, "~", 1);
+            }
+        }
+        else
+        {
+            int rsize;
+            char *render = editorRowRender(filerow, &rsize);
+            int len = rsize - E.coloff;
+            if (len < 0)
+                len = 0;
+            //截断超过窗口的部分
+            if (len > E.screencols)
+                len = E.screencols;
+            if (E.search.active && editorDrawMatches(&line, filerow, render, len))
+            {
+                editorFlushLine(ab, y, line.b, line.len, 0);
+                continue;
+            }
+            editorFlushLine(ab, y, len ? &render[E.coloff] : "", len, 1);
+            continue;
+        }
+        editorFlushLine(ab, y, line.b, line.len, 1);
+    }
+    abFree(&line);
+}
+//绘制状态栏
+void editorDrawStatusBar(struct abuf *ab)
+{
+    struct abuf line = ABUF_INIT;
+    //修改颜色
+    abAppend(&line, "\x1b[7m", 4);
+    char status[80], rstatus[160];
+    //打印路径（新建文件路径为[No Name]）与文件行数
+    //如果文件已被修改，则在文件名后显示(已修改)。
+    //文件尚未全部切分时行数后面显示+，并显示切分进度
+    char loading[24] = "";
+    if (!editorLoaded())
+        snprintf(loading, sizeof(loading), " loading %d%%", editorLoadPercent());
+    int len = snprintf(status, sizeof(status), "%.20s - %d%s lines %s%s",
+                       E.filename ? E.filename : "[No Name]", E.numrows,
+                       editorLoaded() ? "" : "+", E.dirty ? "(modified)" : "",
+                       loading);
+    //调试模式下显示上一帧写出的字节数、合并的输入事件数和各自的平均值，
+    //以及行文本和渲染已用/申请的内存
+    char debug[112] = "";
+    if (E.debug)
+    {
+        long long used, reserved;
+        slabStats(&used, &reserved);
+        snprintf(debug, sizeof(debug), "%dB/frame avg %lldB %dev/frame avg %.1f | "
+                                       "rows %lldK/%lldK | ",
+                 E.frame.bytes, E.frame.frames ? E.frame.total / E.frame.frames : 0,
+                 E.frame.events,
+                 E.frame.frames ? (double)E.frame.allevents / E.frame.frames : 0,
+                 used >> 10, reserved >> 10);
+    }
+    //查找时显示光标处是第几个匹配，仍在扫描时匹配总数后面显示+
+    char match[48] = "";
+    if (E.search.active)
+    {
+        int index, complete;
+        int total = editorSearchCount(E.cy, E.cx, &index, &complete);
+        if (index)
+            snprintf(match, sizeof(match), "match %d of %d%s | ", index, total,
+                     complete ? "" : "+");
+        else
+            snprintf(match, sizeof(match), "%d%s matches | ", total,
+                     complete ? "" : "+");
+    }
+    //打印光标所在行数与文件总行数
+    int rlen = snprintf(rstatus, sizeof(rstatus), "%s%s%d/%d%s", debug, match,
+                        E.cy + 1, E.numrows, editorLoaded() ? "" : "+");
+    if (rlen >= (int)sizeof(rstatus))
+        rlen = sizeof(rstatus) - 1;
+    //窗口不够大，信息截断；两条信息放不下时截断左边的，保留右边的
+    if (len > E.screencols)
+        len = E.screencols;
+    if (len + rlen > E.screencols && rlen <= E.screencols)
+        len = E.screencols - rlen;
+    abAppend(&line, status, len);
+    while (len < E.screencols)
+    { //当第2条信息的尾部与窗口对齐
+        if (E.screencols - len == rlen)
+        {
+            abAppend(&line, rstatus, rlen);
+            break;
+        }
+        else
+        { //在两条信息间打印空格
+            abAppend(&line, " ", 1);
+            len++;
+        }
+    }
+    //将颜色调回
+    abAppend(&line, "\x1b[m", 3);
+    editorFlushLine(ab, E.screenrows, line.b, line.len, 0);
+    abFree(&line);
+}
+
+//绘制状态信息
+void editorDrawMessageBar(struct abuf *ab)
+{
+    //输入框打开时一直显示提示和输入内容
+    if (E.prompt.active)
+        editorSetStatusMessage(E.prompt.fmt, E.prompt.buf);
+    int msglen = strlen(E.statusmsg);
+    if (msglen > E.screencols)
+        msglen = E.screencols;
+    if (!msglen || time(NULL) - E.statusmsg_time >= 5)
+        msglen = 0;
+    editorFlushLine(ab, E.screenrows + 1, E.statusmsg, msglen, 1);
+}
+
+//刷新屏幕
+void editorRefreshScreen()
+{
+    E.frame.events = E.frame.queued;
+    E.frame.allevents += E.frame.queued;
+    E.frame.queued = 0;
+    clock_gettime(CLOCK_MONOTONIC, &E.frame.last);
+    editorLoadMerge(0);
+    editorSearchPoll();
+    editorSavePoll(0);
+    editorScroll();
+
+    struct abuf *ab = &E.frame.out;
+    //刷新屏幕时隐藏光标
+    abAppend(ab, "\x1b[?25l", 6);
+    if (!E.frame.valid)
+    {
+        int i;
+        for (i = 0; i < E.frame.lines; i++)
+            E.frame.line[i].len = E.frame.line[i].cols = 0;
+    }
+    else
+    { //只有行偏移变化时用滚动代替重绘
+        int d = E.rowoff - E.frame.rowoff;
+        if (d != 0 && E.coloff == E.frame.coloff && d < E.screenrows / 2 &&
+            -d < E.screenrows / 2)
+            editorScrollFrame(ab, d);
+    }
+
+    editorDrawRows(ab);
+    //绘制状态栏栏
+    editorDrawStatusBar(ab);
+    editorDrawMessageBar(ab);
+    E.frame.valid = 1;
+    E.frame.rowoff = E.rowoff;
+    E.frame.coloff = E.coloff;
+
+    char buf[32];
+    //终端使用1引索，C语言使用0引索，注意行坐标采用的是rx
+    snprintf(buf, sizeof(buf), "\x1b[%d;%dH", (E.cy - E.rowoff) + 1,
+             (E.rx - E.coloff) + 1);
+    abAppend(ab, buf, strlen(buf));
+    //显示光标
+    abAppend(ab, "\x1b[?25h", 6);
+
+    //我们将缓冲区的内容一次写入标准输出，缓冲区留给下一帧使用。
+    long long bytes = abFlush(ab, STDOUT_FILENO);
+    if (bytes == -1)
+    { //没有完整写出，终端内容未知
+        editorFrameInvalidate();
+        return;
+    }
+    E.frame.bytes = bytes;
+    E.frame.total += bytes;
+    E.frame.frames++;
+}
+//打印信息
+void editorSetStatusMessage(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(E.statusmsg, sizeof(E.statusmsg), fmt, ap);
+    va_end(ap);
+    E.statusmsg_time = time(NULL);
+}
+
+/*** input ***/
+
+/*结束输入，result为NULL表示取消。先关闭输入框再调用done，done中可以打开下一个输入框*/
+void editorPromptEnd(char *result)
+{
+    struct promptState *P = &E.prompt;
+    editorSetStatusMessage("");
+    if (!result)
+        free(P->buf);
+    P->buf = NULL;
+    P->active = 0;
+    if (P->done)
+        P->done(result);
+    else
+        free(result);
+}
+
+//在输入内容末尾添加一个字符
+void editorPromptAppend(int c)
+{
+    struct promptState *P = &E.prompt;
+    //参数输入空间不够，拓展空间
+    if (P->len == P->cap - 1)
+    {
+        P->cap *= 2;
+        P->buf = realloc(P->buf, P->cap);
+    }
+    P->buf[P->len++] = c;
+    P->buf[P->len] = '\0';
+}
+
+/*处理输入框打开时的一个按键。回调只做不阻塞的工作（增量查找把扫描交给工作线程），
+所以连续输入时每个按键都能及时处理，后面的按键不会排在过时的查找后面*/
+void editorPromptKey(int c)
+{
+    struct promptState *P = &E.prompt;
+    void (*callback)(char *, int) = P->callback;
+    char *buf = P->buf;
+    //确保输入不是特殊字符
+    if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE)
+    {
+        if (P->len != 0)
+            P->buf[--P->len] = '\0';
+    }
+    //取消输入
+    else if (c == '\x1b')
+    {
+        if (callback)
+            callback(buf, c);
+        editorPromptEnd(NULL);
+        return;
+    }
+    else if (c == '\r')
+    {
+        if (P->len != 0)
+        {
+            if (callback)
+                callback(buf, c);
+            editorPromptEnd(buf);
+            return;
+        }
+    }
+    else if (c == PASTE_KEY)
+    { //粘贴到输入框：只取可打印字符，整段粘贴后回调一次
+        int i;
+        for (i = 0; i < E.input.pastelen; i++)
+        {
+            unsigned char ch = E.input.paste[i];
+            if (!iscntrl(ch) && ch < 128)
+                editorPromptAppend(ch);
+        }
+    }
+    else if (!iscntrl(c) && c < 128)
+    {
+        editorPromptAppend(c);
+    }
+
+    if (callback)
+        callback(P->buf, c);
+}
+
+/*打开输入框后立即返回，之后的按键由主循环的editorProcessKeypress交给editorPromptKey，
+后台查找和切分的结果照常逐步显示。确认或取消时调用done*/
+void editorPrompt(const char *prompt, void (*callback)(char *, int), void (*done)(char *))
+{
+    struct promptState *P = &E.prompt;
+    P->fmt = prompt;
+    P->cap = 128;
+    P->buf = malloc(P->cap);
+    P->len = 0;
+    P->buf[0] = '\0';
+    P->callback = callback;
+    P->done = done;
+    P->cx = E.cx;
+    P->cy = E.cy;
+    P->coloff = E.coloff;
+    P->rowoff = E.rowoff;
+    P->active = 1;
+}
+
+//光标移动
+void editorMoveCursor(int key)
+{
+    editorLoadRows(E.cy + 2);
+    //防止光标的列数大于文本
+    int rowlen = (E.cy >= E.numrows) ? 0 : editorRow(E.cy).size;
+
+    switch (key)
+    {
+    case ARROW_LEFT:
+        //防止出现负数越界
+        if (E.cx != 0)
+        {
+            E.cx--;
+        }
+        //从行头切换到上一行的行尾。
+        else if (E.cy > 0)
+        {
+            E.cy--;
+            E.cx = editorRow(E.cy).size;
+        }
+        break;
+    case ARROW_RIGHT:
+        //防止光标超过该行的文本
+        if (E.cy < E.numrows && E.cx < rowlen)
+        {
+            E.cx++;
+        }
+        //行尾按右箭头跳转到下一行行首
+        else if (E.cy < E.numrows && E.cx == rowlen)
+        {
+            E.cy++;
+            E.cx = 0;
+        }
+        break;
+    case ARROW_UP:
+        if (E.cy != 0)
+        {
+            E.cy--;
+        }
+        break;
+    case ARROW_DOWN:
+        if (E.cy < E.numrows)
+        {
+            E.cy++;
+        }
+        break;
+    }
+    //如果如果上一行的长度大于下一行，从较长一行的尾，切换到下一行的行尾
+
+    rowlen = (E.cy >= E.numrows) ? 0 : editorRow(E.cy).size;
+    if (E.cx > rowlen)
+    {
+        E.cx = rowlen;
+    }
+}
+
+//将把各种Ctrl键组合和其他特殊键映射到不同的编辑器函数，并将任何字母数字和其他可打印键的字符插入到正在编辑的文本中。
+void editorProcessKeypress()
+{
+    static int quit_times = KILO_QUIT_TIMES;
+
+    int c = editorReadKey();
+    if (E.prompt.active)
+    {
+        editorPromptKey(c);
+        return;
+    }
+    //确认查找后马上按了键：先完成跳转，按键作用在匹配位置上
+    if (E.search.pending && c != '\x1b')
+        editorSearchJump(1);
+    E.search.pending = 0;
+
+    switch (c)
+    {
+    case '\r':
+        editorInsertNewline();
+        break;
+        //根据文件的修改程度与按ctrl-q的次数，在未保存的情况下，需连按3次ctrl-q
+
+    case CTRL_KEY('q'):
+        //正在保存时先等它完成，修改计数才准确
+        editorSaveWait();
+        if (E.dirty && quit_times > 0)
+        {
+            editorSetStatusMessage("WARNING!!! File has unsaved changes. "
+                                   "Press Ctrl-Q %d more times to quit.",
+                                   quit_times);
+            quit_times--;
+            return;
+        }
+        //未保存的修改留在日志里，下次打开时可以恢复
+        editorJournalClose();
+        //退出时，刷新屏幕
+        write(STDOUT_FILENO, "\x1b[2J", 4);
+        //退出时重置光标位置
+        write(STDOUT_FILENO, "\x1b[H", 3);
+        exit(0);
+        break;
+    //保存
+    case CTRL_KEY('s'):
+        editorSave();
+        break;
+    //撤销
+    case CTRL_KEY('z'):
+        editorUndo();
+        break;
+        //重做
+    case CTRL_KEY('y'):
+        editorRedo();
+        break;
+    //回到行头部
+    case HOME_KEY:
+        E.cx = 0;
+        break;
+    //去行尾
+    case END_KEY:
+        if (E.cy < E.numrows)
+            E.cx = editorRow(E.cy).size;
+        break;
+
+    //查找
+    case CTRL_KEY('f'):
+        editorFind();
+        break;
+
+    //替换
+    case CTRL_KEY('r'):
+        editorReplace();
+        break;
+    //删除
+    case BACKSPACE:
+    case CTRL_KEY('h'):
+
+    case DEL_KEY:
+        if (c == DEL_KEY)
+            //DEL建相当于先按一次右箭头，再删除
+            editorMoveCursor(ARROW_RIGHT);
+        editorDelChar();
+        break;
+
+    case PAGE_UP:
+    case PAGE_DOWN:
+    { //向上翻页到窗口顶部之上一屏，向下翻页到窗口底部之下一屏，直接按行号定位
+        if (c == PAGE_UP)
+        {
+            E.cy = E.rowoff - E.screenrows;
+            if (E.cy < 0)
+                E.cy = 0;
+        }
+        else
+        {
+            editorLoadRows(E.rowoff + 2 * E.screenrows);
+            E.cy = E.rowoff + 2 * E.screenrows - 1;
+            if (E.cy > E.numrows)
+                E.cy = E.numrows;
+        }
+        int rowlen = E.cy < E.numrows ? editorRow(E.cy).size : 0;
+        if (E.cx > rowlen)
+            E.cx = rowlen;
+    }
+    break;
+    //跳转到指定行
+    case CTRL_KEY('g'):
+        editorGoto();
+        break;
+        //方向键
+    case ARROW_UP:
+    case ARROW_DOWN:
+    case ARROW_LEFT:
+    case ARROW_RIGHT:
+        editorMoveCursor(c);
+        break;
+
+    case PASTE_KEY:
+        editorInsertPaste(E.input.paste, E.input.pastelen);
+        break;
+
+    case CTRL_KEY('l'):
+        break;
+    //去掉查找匹配的高亮
+    case '\x1b':
+        editorSearchClear();
+        break;
+        //若按键不特殊，就插入
+
+    default:
+        editorInsertChar(c);
+        break;
+    }
+    //若输入非ctrl-q，重置退出警告次数
+    quit_times = KILO_QUIT_TIMES;
+}
+
+/*** benchmark ***/
+#ifdef KILO_BENCH
+/*用 gcc -DKILO_BENCH 编译后运行 ./kilo --bench [MB...]，
+生成短行、长行、混合行长（含\r\n）三种合成文件，分别测量读入、单线程切分和并行切分的速度*/
+
+//生成合成文件，mix为0短行、1长行、2混合、3源代码式、4日志式
+void benchGenerate(const char *path, size_t size, int mix)
+{
+    FILE *fp = fopen(path, "w");
+    if (!fp)
+        die("fopen");
+    static char block[1 << 20];
+    unsigned seed = 12345;
+    size_t written = 0;
+    while (written < size)
+    {
+        size_t n = 0;
+        while (n < sizeof(block) - 8192)
+        {
+            seed = seed * 1103515245 + 12345;
+            int len, indent = -1;
+            if (mix == 0)
+                len = 4 + (seed >> 16) % 24;
+            else if (mix == 1)
+                len = 200 + (seed >> 16) % 800;
+            else if (mix == 2)
+                len = (seed >> 8) % 64 == 0 ? 4096 : (seed >> 16) % 120;
+            else if (mix == 3)
+            { //空行、单独的括号，其余是缩进的语句
+                int r = (seed >> 16) % 100;
+                indent = (seed >> 10) % 4;
+                len = r < 15 ? 0 : r < 27 ? indent + 1 : indent + 8 + (int)((seed >> 20) % 50);
+            }
+            else
+            {
+                indent = 0;
+                len = 60 + (seed >> 16) % 100;
+            }
+            int j;
+            for (j = 0; j < len; j++)
+                if (indent >= 0) //只有行首缩进是制表符
+                    block[n++] = j < indent ? '\t' : (j + seed) % 6 == 0 ? ' ' : 'a' + (j + seed) % 26;
+                else
+                    block[n++] = (j % 9 == 8) ? '\t' : 'a' + (j + seed) % 26;
+            if (mix == 2 && (seed >> 20) % 4 == 0)
+                block[n++] = '\r';
+            block[n++] = '\n';
+        }
+        if (n > size - written)
+            n = size - written;
+        fwrite(block, 1, n, fp);
+        written += n;
+    }
+    fclose(fp);
+}
+
+double benchNow()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*测试不经过initEditor（没有终端），在这里做各个测试共用的初始化：
+没有打开的日志，锁、查找线程池和渲染缓存都已建立，撤销记录用默认上限*/
+void benchInit()
+{
+    pthread_mutex_init(&E.load.lock, NULL);
+    pthread_cond_init(&E.load.cond, NULL);
+    pthread_mutex_init(&E.journal.lock, NULL);
+    pthread_cond_init(&E.journal.cond, NULL);
+    pthread_cond_init(&E.journal.done, NULL);
+    E.journal.fd = -1;
+    E.input.wake[0] = E.input.wake[1] = -1;
+    E.loadthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (E.loadthreads < 1)
+        E.loadthreads = 1;
+    if (E.loadthreads > KILO_LOAD_MAX_THREADS)
+        E.loadthreads = KILO_LOAD_MAX_THREADS;
+    editorSearchInit(E.loadthreads);
+    editorRenderInit(KILO_RENDER_CACHE);
+    E.undo.limit = KILO_UNDO_MEM_LIMIT;
+}
+
+//释放已打开的文件，恢复到空缓冲区
+void benchReset()
+{
+    editorSearchClear();
+    editorUndoReset();
+    editorFreeRows();
+    if (E.origmapped)
+        munmap(E.orig, E.origlen);
+    else
+        free(E.orig);
+    E.orig = NULL;
+    E.origlen = E.origscan = 0;
+    E.origmapped = 0;
+    //编辑产生的日志写完后删除
+    struct journalState *J = &E.journal;
+    if (J->fd != -1)
+    {
+        editorJournalSync();
+        close(J->fd);
+        J->fd = -1;
+        unlink(J->path);
+    }
+    J->failed = 0;
+}
+
+//测量把path读入并切分成行的速度
+void benchLoad(const char *path, int threads, double *readmbs, double *splitmbs, int *rows)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+        die("open");
+    double t0 = benchNow();
+    E.orig = editorReadFile(fd, &E.origlen);
+    close(fd);
+    double t1 = benchNow();
+    E.loadthreads = threads;
+    editorLoadAll();
+    double t2 = benchNow();
+    double mb = E.origlen / 1048576.0;
+    *readmbs = mb / (t1 - t0);
+    *splitmbs = mb / (t2 - t1);
+    *rows = E.numrows;
+    benchReset();
+}
+
+/*原来的逐行KMP查找（修正了固定大小的数组），作为查找速度的对照。
+每次调用都重新计算next数组，返回匹配个数*/
+int benchKMP(const char *s, int sLen, const char *p, int pLen)
+{
+    int *next = malloc(sizeof(int) * (pLen + 1));
+    int r = -1;
+    int t = 0;
+    next[0] = -1;
+    while (t < pLen)
+    {
+        if (r == -1 || p[r] == p[t])
+        {
+            r++;
+            t++;
+            next[t] = r;
+        }
+        else
+        {
+            r = next[r];
+        }
+    }
+    int i = 0;
+    int j = 0;
+    int k = 0;
+    while (i < sLen)
+    {
+        if (j == -1 || s[i] == p[j])
+        {
+            i++;
+            j++;
+            if (j == pLen)
+            {
+                k++;
+                j = next[j];
+            }
+        }
+        else
+        {
+            j = next[j];
+        }
+    }
+    free(next);
+    return k;
+}
+
+/*在所有行中查找query，返回匹配个数，*mbs为查找速度。
+mode为0时逐行KMP，1时单线程SIMD查找，2时用查找线程池，
+3时单线程正则查找，4时用查找线程池正则查找*/
+int benchSearchRows(const char *query, int mode, double *mbs)
+{
+    int len = strlen(query);
+    int count = 0;
+    int i;
+    double t0 = benchNow();
+    if (mode == 2 || mode == 4)
+    {
+        E.search.regex = mode == 4;
+        editorSearchStart(query, len, 0, 1);
+        editorSearchFinish();
+        count = E.search.nmatch;
+        editorSearchClear();
+        E.search.regex = 0;
+        *mbs = E.origlen / 1048576.0 / (benchNow() - t0);
+        return count;
+    }
+    searchPattern sp;
+    regexCache rc = {0};
+    searchMatch *m = NULL;
+    int n, cap = 0;
+    searchCompile(&sp, query, len, mode == 3);
+    for (i = 0; i < E.numrows; i++)
+    {
+        erow row = editorRow(i);
+        if (mode == 0)
+        {
+            count += benchKMP(row.chars, row.size, query, len);
+            continue;
+        }
+        if (mode == 3)
+        {
+            n = 0;
+            searchRow(&sp, &rc, &row, i, &m, &n, &cap);
+            count += n;
+            continue;
+        }
+        int at = searchNext(&sp, row.chars, row.size, 0);
+        while (at != -1)
+        {
+            count++;
+            at = searchNext(&sp, row.chars, row.size, at + 1);
+        }
+    }
+    free(m);
+    regexCacheFree(&rc);
+    searchFree(&sp);
+    *mbs = E.origlen / 1048576.0 / (benchNow() - t0);
+    return count;
+}
+
+/*模拟逐个输入query的字符，输出每次按键后扫描完全部行的毫秒数。
+refine为1时在上一次的结果中验证，为0时每次都重新查找*/
+void benchSearchTyping(const char *query, int refine)
+{
+    int len = strlen(query);
+    int k;
+    double keymax = 0;
+    printf("    %s:", refine ? "refine" : "rescan");
+    for (k = 1; k <= len; k++)
+    {
+        double t0 = benchNow();
+        if (refine)
+            editorSearchRefine(query, k, 0, 1);
+        else
+            editorSearchStart(query, k, 0, 1);
+        //按键处理本身的耗时，扫描在工作线程中继续
+        double t1 = benchNow();
+        if (t1 - t0 > keymax)
+            keymax = t1 - t0;
+        editorSearchFinish();
+        printf(" %.1f", (benchNow() - t0) * 1000);
+    }
+    printf(" ms (%d matches, key max %.2f ms)\n", E.search.nmatch, keymax * 1000);
+    editorSearchClear();
+}
 
-char *editorPrompt(char *prompt, void (*callback)(char *, int))
+//把全部query替换成rep，输出查找、替换和撤销各自的耗时
+void benchReplace(const char *query, const char *rep)
 {
-    size_t bufsize = 128;
-    char *buf = malloc(bufsize);
+    int n, rows;
+    double t0 = benchNow();
+    editorSearchStart(query, strlen(query), 0, 1);
+    searchMatch *m = editorSearchTake(&n);
+    double t1 = benchNow();
+    int count = editorReplaceAll(m, n, rep, &rows);
+    double t2 = benchNow();
+    editorUndo();
+    double t3 = benchNow();
+    printf("    replace %s: %d matches on %d lines, search %.0f ms, replace %.0f ms, undo %.0f ms\n",
+           query, count, rows, (t1 - t0) * 1000, (t2 - t1) * 1000, (t3 - t2) * 1000);
+    free(m);
+    editorUndoReset();
+}
 
-    size_t buflen = 0;
-    buf[0] = '\0';
+/*用 ./kilo --bench-search [MB...] 运行，比较逐行KMP、单线程SIMD查找和多线程查找
+在各种文件上的速度，查找一个常见的短串、一个不存在的长串。
+再用几种正则表达式（纯字面、有字面前缀、没有前缀需要反向扫描、不存在的分支）比较正则查找
+与字面查找的速度，最后测量全部替换一个常见的短串*/
+int benchSearchMain(int argc, char *argv[])
+{
+    static const int defsizes[] = {100, 1024};
+    static const char *mixname[] = {"short", "long", "mixed"};
+    static const char *queries[] = {"abc", "zzzzqqqqxxxxzzzzqqqqxxxx"};
+    static const char *regexes[] = {"abc", "ab[c-e]+f", "[a-c]bc", "\\tq[a-z]*$", "zzzq|qqqz"};
+    int nsizes = argc > 0 ? argc : 2;
+    const char *dir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/kilo-bench-%d.txt", dir, (int)getpid());
 
-    while (1)
+    benchInit();
+    int threads = E.loadthreads;
+    printf("%8s %6s %26s %10s %12s %12s %12s\n", "size", "mix", "query", "matches",
+           "KMP MB/s", "SIMD MB/s", "par MB/s");
+    int i, mix, q;
+    for (i = 0; i < nsizes; i++)
     {
-        editorSetStatusMessage(prompt, buf);
-        editorRefreshScreen();
-        //确保输入不是特殊字符
-        int c = editorReadKey();
-        if (c == DEL_KEY || c == CTRL_KEY('h') || c == BACKSPACE)
-        {
-            if (buflen != 0)
-                buf[--buflen] = '\0';
-        }
-        //取消输入
-        else if (c == '\x1b')
+        int mb = argc > 0 ? atoi(argv[i]) : defsizes[i];
+        for (mix = 0; mix < 3; mix++)
         {
-            editorSetStatusMessage("");
-            if (callback)
-                callback(buf, c);
-            free(buf);
-            return NULL;
-        }
-        else if (c == '\r')
-        { //参数输入空间不够，拓展空间
-            if (buflen != 0)
+            benchGenerate(path, (size_t)mb << 20, mix);
+            int fd = open(path, O_RDONLY);
+            if (fd == -1)
+                die("open");
+            E.orig = editorReadFile(fd, &E.origlen);
+            close(fd);
+            editorLoadAll();
+            double literal = 0;
+            for (q = 0; q < 2; q++)
             {
-                editorSetStatusMessage("");
-                if (callback)
-                    callback(buf, c);
-                return buf;
+                double kmp, simd, par;
+                int n1 = benchSearchRows(queries[q], 0, &kmp);
+                int n2 = benchSearchRows(queries[q], 1, &simd);
+                int n3 = benchSearchRows(queries[q], 2, &par);
+                if (n1 != n2 || n2 != n3)
+                    printf("mismatch: KMP %d, SIMD %d, par %d\n", n1, n2, n3);
+                printf("%6dMB %6s %26s %10d %12.0f %12.0f %12.0f\n", mb, mixname[mix],
+                       queries[q], n2, kmp, simd, par);
+                fflush(stdout);
+                if (q == 0)
+                    literal = simd;
             }
-        }
-        else if (!iscntrl(c) && c < 128)
-        {
-            if (buflen == bufsize - 1)
+            for (q = 0; q < (int)(sizeof(regexes) / sizeof(regexes[0])); q++)
             {
-                bufsize *= 2;
-                buf = realloc(buf, bufsize);
+                double single, par;
+                int n1 = benchSearchRows(regexes[q], 3, &single);
+                int n2 = benchSearchRows(regexes[q], 4, &par);
+                if (n1 != n2)
+                    printf("mismatch: regex %d, par %d\n", n1, n2);
+                printf("    regex %-12s %10d %8.0f MB/s (%.2fx literal) %8.0f MB/s par\n",
+                       regexes[q], n1, single, single / literal, par);
+                fflush(stdout);
             }
-            buf[buflen++] = c;
-            buf[buflen] = '\0';
+            //逐字输入查找串时每次按键的耗时
+            benchSearchTyping("abcdefgh", 0);
+            benchSearchTyping("abcdefgh", 1);
+            benchReplace("abc", "XYZW");
+            benchReset();
         }
-
-        if (callback)
-            callback(buf, c);
     }
+    unlink(path);
+    printf("(%d threads)\n", threads);
+    return 0;
 }
-//光标移动
-void editorMoveCursor(int key)
-{ //防止光标的列数大于文本
-    erow *row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
 
-    switch (key)
+//在第at行逐个插入n个字符，返回每次插入的平均耗时（纳秒）
+double benchTypeOnce(int at, int n)
+{
+    int i;
+    double t0 = benchNow();
+    for (i = 0; i < n; i++)
+        editorInsertText(at, i, "x", 1);
+    return (benchNow() - t0) * 1e9 / n;
+}
+
+//保存一次并等待完成，返回耗时（毫秒）
+double benchSaveOnce()
+{
+    double t0 = benchNow();
+    editorSave();
+    editorSaveWait();
+    return (benchNow() - t0) * 1000;
+}
+
+/*用 ./kilo --bench-save [MB...] 运行：打开（映射）合成文件，在末尾附近修改一行，
+比较完整写临时文件再改名、从修改处重写到末尾、长度不变时就地覆盖三种保存的耗时*/
+int benchSaveMain(int argc, char *argv[])
+{
+    static const int defsizes[] = {100, 1024};
+    int nsizes = argc > 0 ? argc : 2;
+    const char *dir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/kilo-bench-%d.txt", dir, (int)getpid());
+    benchInit();
+    E.loadthreads = 1;
+    printf("%8s %10s %12s %12s %12s %10s %10s\n", "size", "rows", "atomic ms", "delta ms",
+           "patch ms", "type ns", "+journal");
+    int i;
+    for (i = 0; i < nsizes; i++)
     {
-    case ARROW_LEFT:
-        //防止出现负数越界
-        if (E.cx != 0)
+        int mb = argc > 0 ? atoi(argv[i]) : defsizes[i];
+        double ms[3];
+        int mode, rows = 0;
+        benchGenerate(path, (size_t)mb << 20, 0);
+        for (mode = 0; mode < 3; mode++)
         {
-            E.cx--;
+            E.savemode = mode == 0 ? SAVE_ATOMIC : SAVE_DELTA;
+            editorOpen(path);
+            editorLoadAll();
+            rows = E.numrows;
+            int at = E.numrows - 10;
+            if (mode == 2)
+            { //改写一个字符，总长不变
+                free(editorDeleteText(at, 0, 1, NULL));
+                editorInsertText(at, 0, "X", 1);
+            }
+            else
+            {
+                editorInsertText(at, 0, "XY", 2);
+            }
+            ms[mode] = benchSaveOnce();
+            benchReset();
         }
-        //从行头切换到上一行的行尾。
-        else if (E.cy > 0)
+        //逐字输入的耗时，不记日志与记日志（只追加到内存，写盘在后台）对比
+        double ns[2];
+        for (mode = 0; mode < 2; mode++)
         {
-            E.cy--;
-            E.cx = E.row[E.cy].size;
+            editorOpen(path);
+            editorLoadAll();
+            E.journal.failed = mode == 0;
+            ns[mode] = benchTypeOnce(E.numrows / 2, 100000);
+            benchReset();
         }
-        break;
-    case ARROW_RIGHT:
-        //防止光标超过该行的文本
-        if (row && E.cx < row->size)
+        printf("%6dMB %10d %12.1f %12.1f %12.1f %10.0f %10.0f\n", mb, rows, ms[0], ms[1], ms[2],
+               ns[0], ns[1]);
+        fflush(stdout);
+    }
+    unlink(path);
+    return 0;
+}
+
+/*用 ./kilo --bench-alloc [MB...] 运行：打开短行合成文件，修改每一行（复制一份并插入字符），
+再逐个字符加长到几十字节，最后关闭缓冲区。比较直接malloc与slab分配的耗时，并输出slab的统计*/
+int benchAllocMain(int argc, char *argv[])
+{
+    static const int defsizes[] = {100};
+    int nsizes = argc > 0 ? argc : 1;
+    const char *dir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/kilo-bench-%d.txt", dir, (int)getpid());
+    benchInit();
+    E.loadthreads = 1;
+    printf("%8s %10s %8s %10s %10s %10s %12s %12s\n", "size", "rows", "alloc", "touch ms",
+           "grow ms", "free ms", "used MB", "reserved MB");
+    int i, off;
+    for (i = 0; i < nsizes; i++)
+    {
+        int mb = argc > 0 ? atoi(argv[i]) : defsizes[i];
+        benchGenerate(path, (size_t)mb << 20, 0);
+        for (off = 1; off >= 0; off--)
         {
-            E.cx++;
+            E.slab.off = off;
+            editorOpen(path);
+            editorLoadAll();
+            int rows = E.numrows, j, k;
+            double t0 = benchNow();
+            for (j = 0; j < rows; j++)
+                editorRowInsertString(j, 0, "x", 1);
+            double t1 = benchNow();
+            for (k = 0; k < 48; k++)
+                for (j = 0; j < rows; j += 8)
+                    editorRowAppendString(j, "y", 1);
+            double t2 = benchNow();
+            long long used, reserved;
+            slabStats(&used, &reserved);
+            editorFreeRows();
+            double t3 = benchNow();
+            printf("%6dMB %10d %8s %10.1f %10.1f %10.1f", mb, rows, off ? "malloc" : "slab",
+                   (t1 - t0) * 1000, (t2 - t1) * 1000, (t3 - t2) * 1000);
+            if (off)
+                printf("\n");
+            else
+                printf(" %12.1f %12.1f\n", used / 1048576.0, reserved / 1048576.0);
+            fflush(stdout);
+            benchReset();
         }
-        //行尾按右箭头跳转到下一行行首
-        else if (row && E.cx == row->size)
+    }
+    E.slab.off = 0;
+    unlink(path);
+    return 0;
+}
+
+//进程匿名内存（堆、slab块等，不含映射的文件页）的常驻大小，单位字节
+long long benchRssAnon()
+{
+    FILE *fp = fopen("/proc/self/status", "r");
+    char line[256];
+    long long kb = 0;
+    while (fp && fgets(line, sizeof(line), fp))
+        if (sscanf(line, "RssAnon: %lld", &kb) == 1)
+            break;
+    if (fp)
+        fclose(fp);
+    return kb * 1024;
+}
+
+/*用 ./kilo --bench-mem [MB...] 运行：分别打开源代码式和日志式的合成文件，测量切分后行索引
+占用的常驻内存（每行字节数），逐行渲染一遍的耗时，以及修改每一行（行首插入一个字符）后
+行内容占用的内存。每种文件在单独的子进程中测量，互不影响*/
+int benchMemMain(int argc, char *argv[])
+{
+    static const int defsizes[] = {100};
+    static const char *mixname[] = {"source", "log"};
+    int nsizes = argc > 0 ? argc : 1;
+    const char *dir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/kilo-bench-%d.txt", dir, (int)getpid());
+    benchInit();
+    E.loadthreads = 1;
+    printf("%8s %7s %10s %8s %12s %12s %12s\n", "size", "mix", "rows", "avg len", "load B/row",
+           "render ms", "edit B/row");
+    int i, mix;
+    for (i = 0; i < nsizes; i++)
+    {
+        int mb = argc > 0 ? atoi(argv[i]) : defsizes[i];
+        for (mix = 0; mix < 2; mix++)
         {
-            E.cy++;
-            E.cx = 0;
+            benchGenerate(path, (size_t)mb << 20, 3 + mix);
+            fflush(stdout);
+            pid_t pid = fork();
+            if (pid == -1)
+                die("fork");
+            if (pid > 0)
+            {
+                waitpid(pid, NULL, 0);
+                continue;
+            }
+            long long m0 = benchRssAnon();
+            editorOpen(path);
+            editorLoadAll();
+            long long m1 = benchRssAnon();
+            int rows = E.numrows, j, rsize;
+            double t0 = benchNow();
+            for (j = 0; j < rows; j++)
+                editorRowRender(j, &rsize);
+            double t1 = benchNow();
+            long long m2 = benchRssAnon();
+            for (j = 0; j < rows; j++)
+                editorRowInsertString(j, 0, "x", 1);
+            long long m3 = benchRssAnon();
+            printf("%6dMB %7s %10d %8.1f %12.1f %12.1f %12.1f\n", mb, mixname[mix], rows,
+                   (double)E.origlen / rows - 1, (double)(m1 - m0) / rows, (t1 - t0) * 1000,
+                   (double)(m3 - m2) / rows);
+            fflush(stdout);
+            _exit(0);
         }
-        break;
-    case ARROW_UP:
-        if (E.cy != 0)
+    }
+    unlink(path);
+    return 0;
+}
+
+//原来的cx到rx换算：从行首逐个字符累加，作对照
+int benchCxToRxScan(erow *row, int cx)
+{
+    int rx = 0;
+    int j;
+    for (j = 0; j < cx; j++)
+    {
+        if (row->chars[j] == '\t')
+            rx += (KILO_TAB_STOP - 1) - (rx % KILO_TAB_STOP);
+        rx++;
+    }
+    return rx;
+}
+
+/*用 ./kilo --bench-rx [KB...] 运行：生成一行含制表符的长行，光标在行尾附近时比较
+逐字符换算与制表符索引二分查找的耗时，以及在行尾附近输入一个字符再换算的耗时（纳秒）*/
+int benchRxMain(int argc, char *argv[])
+{
+    static const int defsizes[] = {1, 64, 1024, 16384};
+    int nsizes = argc > 0 ? argc : 4;
+    benchInit();
+    printf("%8s %10s %12s %12s %12s\n", "line", "tabs", "scan ns", "index ns", "type ns");
+    int i, j;
+    for (i = 0; i < nsizes; i++)
+    {
+        int kb = argc > 0 ? atoi(argv[i]) : defsizes[i];
+        int len = kb << 10;
+        char *buf = malloc(len);
+        int tabs = 0;
+        srand(1);
+        for (j = 0; j < len; j++)
         {
-            E.cy--;
+            buf[j] = rand() % 8 == 0 ? '\t' : 'a' + rand() % 26;
+            tabs += buf[j] == '\t';
         }
-        break;
-    case ARROW_DOWN:
-        if (E.cy < E.numrows)
+        editorInsertRow(0, buf, len);
+        free(buf);
+        int iters = 10000, cx = len - 8;
+        volatile int sink = 0;
+        erow row = editorRow(0);
+        double t0 = benchNow();
+        for (j = 0; j < iters; j++)
+            sink += benchCxToRxScan(&row, cx - j % 8);
+        double t1 = benchNow();
+        for (j = 0; j < iters; j++)
+            sink += editorRowCxToRx(0, cx - j % 8);
+        double t2 = benchNow();
+        for (j = 0; j < iters; j++)
         {
-            E.cy++;
+            editorRowInsertString(0, cx, "x", 1);
+            sink += editorRowCxToRx(0, cx + 1);
         }
-        break;
+        double t3 = benchNow();
+        row = editorRow(0);
+        if (editorRowCxToRx(0, cx) != benchCxToRxScan(&row, cx))
+            printf("mismatch\n");
+        printf("%6dKB %10d %12.1f %12.1f %12.1f\n", kb, tabs, (t1 - t0) * 1e9 / iters,
+               (t2 - t1) * 1e9 / iters, (t3 - t2) * 1e9 / iters);
+        fflush(stdout);
+        benchReset();
     }
-    //如果如果上一行的长度大于下一行，从较长一行的尾，切换到下一行的行尾
+    return 0;
+}
 
-    row = (E.cy >= E.numrows) ? NULL : &E.row[E.cy];
-    int rowlen = row ? row->size : 0;
-    if (E.cx > rowlen)
+//缓冲区的内容（每行加上换行）与want相同时返回1
+int benchCheckText(const char *want)
+{
+    size_t n = strlen(want), off = 0;
+    int j;
+    for (j = 0; j < E.numrows; j++)
     {
-        E.cx = rowlen;
+        erow row = editorRow(j);
+        if (off + row.size + 1 > n || memcmp(want + off, row.chars, row.size) != 0 ||
+            want[off + row.size] != '\n')
+            return 0;
+        off += row.size + 1;
     }
+    return off == n;
 }
 
-//将把各种Ctrl键组合和其他特殊键映射到不同的编辑器函数，并将任何字母数字和其他可打印键的字符插入到正在编辑的文本中。
-void editorProcessKeypress()
+//把按键序列放进输入缓冲，相当于一次从终端读到这些字节
+void benchFeed(const char *s, int len)
 {
-    static int quit_times = KILO_QUIT_TIMES;
-
-    int c = editorReadKey();
+    int i;
+    for (i = 0; i < len; i++)
+        E.input.buf[E.input.tail++ & (KILO_INPUT_BUF - 1)] = s[i];
+}
 
-    switch (c)
+/*在path打开的文件中从第一行起翻页n次，queued为1时n个PAGE_DOWN一起到达、合并成一帧处理，
+否则每个按键单独一帧。返回最后光标所在的行*/
+int benchCheckPages(int n, int queued)
+{
+    static const char pagedown[] = "\x1b[6~";
+    int i;
+    E.cy = E.cx = E.rowoff = 0;
+    for (i = 0; i < n; i++)
     {
-    case '\r':
-        editorInsertNewline();
-        break;
-        //根据文件的修改程度与按ctrl-q的次数，在未保存的情况下，需连按3次ctrl-q
-
-    case CTRL_KEY('q'):
-        if (E.dirty && quit_times > 0)
-        {
-            editorSetStatusMessage("WARNING!!! File has unsaved changes. "
-                                   "Press Ctrl-Q %d more times to quit.",
-                                   quit_times);
-            quit_times--;
-            return;
-        }
-        //退出时，刷新屏幕
-        write(STDOUT_FILENO, "\x1b[2J", 4);
-        //退出时重置光标位置
-        write(STDOUT_FILENO, "\x1b[H", 3);
-        exit(0);
-        break;
-    //保存
-    case CTRL_KEY('s'):
-        editorSave();
-        break;
-    //撤销
-    case CTRL_KEY('z'):
-        editorUndo();
-        break;
-        //重做
-    case CTRL_KEY('y'):
-        editorRedo();
-        break;
-    //回到行头部
-    case HOME_KEY:
-        E.cx = 0;
-        break;
-    //去行尾
-    case END_KEY:
-        if (E.cy < E.numrows)
-            E.cx = E.row[E.cy].size;
-        break;
+        benchFeed(pagedown, sizeof(pagedown) - 1);
+        if (!queued)
+            editorProcessInput();
+    }
+    if (queued)
+        editorProcessInput();
+    return E.cy;
+}
 
-    //查找
-    case CTRL_KEY('f'):
-        editorFind();
-        break;
+/*用 ./kilo --check 运行：对编辑操作做回归检查，不一致时输出mismatch并返回1。
+在"a\nb\n"末尾的空行回车只增加一个空行，光标仍在文件末尾的空行；
+删除的撤销记录在删除之后记下被删掉的文本和删除之前的光标，撤销、重做后文本和光标都还原；
+一帧中合并处理的多个PAGE_DOWN与分开按下时翻过同样多的页*/
+int benchCheckMain()
+{
+    const char *dir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/kilo-check-%d.txt", dir, (int)getpid());
+    int fail = 0;
+    benchInit();
+    //按键只来自benchFeed：标准输入换成一个没有数据的管道
+    int in[2];
+    if (pipe(in) == -1 || dup2(in[0], STDIN_FILENO) == -1)
+        die("pipe");
+    FILE *fp = fopen(path, "w");
+    if (!fp)
+        die("fopen");
+    fputs("a\nb\n", fp);
+    fclose(fp);
+    editorOpen(path);
+    editorLoadAll();
+    E.cy = E.numrows;
+    E.cx = 0;
+    editorInsertNewline();
+    if (E.numrows != 3 || E.cy != 3 || !benchCheckText("a\nb\n\n"))
+    {
+        printf("mismatch: newline at end of file: %d rows, cy %d\n", E.numrows, E.cy);
+        fail = 1;
+    }
+    editorInsertChar('x');
+    if (!benchCheckText("a\nb\n\nx\n"))
+    {
+        printf("mismatch: typing after newline at end of file\n");
+        fail = 1;
+    }
+    editorUndo();
+    editorUndo();
+    if (!benchCheckText("a\nb\n") || E.cy != 2 || E.cx != 0)
+    {
+        printf("mismatch: undo newline at end of file: cy %d cx %d\n", E.cy, E.cx);
+        fail = 1;
+    }
+    benchReset();
 
-    //替换
-    case CTRL_KEY('r'):
-        editorReplace();
-        break;
-    //删除
-    case BACKSPACE:
-    case CTRL_KEY('h'):
+    fp = fopen(path, "w");
+    if (!fp)
+        die("fopen");
+    fputs("ab\ncd\n", fp);
+    fclose(fp);
+    editorOpen(path);
+    editorLoadAll();
+    //在第二行行首退格：与上一行合并，记录删掉的换行和按键前的光标
+    E.cy = 1;
+    E.cx = 0;
+    editorDelChar();
+    undoRecord *r = &E.undo.rec[E.undo.current - 1];
+    if (!benchCheckText("abcd\n") || E.cy != 0 || E.cx != 2 || r->type != UNDO_DELETE ||
+        r->row != 0 || r->col != 2 || r->len != 1 || r->text[0] != '\n' || r->cy != 1 ||
+        r->cx != 0)
+    {
+        printf("mismatch: backspace at line start: cy %d cx %d\n", E.cy, E.cx);
+        fail = 1;
+    }
+    //连续两次退格合并成一条记录
+    E.cx = 4;
+    editorDelChar();
+    editorDelChar();
+    r = &E.undo.rec[E.undo.current - 1];
+    if (!benchCheckText("ab\n") || r->len != 2 || memcmp(r->text, "cd", 2) != 0 || r->cx != 4)
+    {
+        printf("mismatch: coalesced backspaces\n");
+        fail = 1;
+    }
+    editorUndo();
+    if (!benchCheckText("abcd\n") || E.cy != 0 || E.cx != 4)
+    {
+        printf("mismatch: undo backspaces: cy %d cx %d\n", E.cy, E.cx);
+        fail = 1;
+    }
+    editorUndo();
+    if (!benchCheckText("ab\ncd\n") || E.cy != 1 || E.cx != 0)
+    {
+        printf("mismatch: undo line join: cy %d cx %d\n", E.cy, E.cx);
+        fail = 1;
+    }
+    editorRedo();
+    if (!benchCheckText("abcd\n") || E.cy != 0 || E.cx != 2)
+    {
+        printf("mismatch: redo line join: cy %d cx %d\n", E.cy, E.cx);
+        fail = 1;
+    }
+    benchReset();
 
-    case DEL_KEY:
-        if (c == DEL_KEY)
-            //DEL建相当于先按一次右箭头，再删除
-            editorMoveCursor(ARROW_RIGHT);
-        if (E.filename != NULL)
-            AddRecord(&S);
+    fp = fopen(path, "w");
+    if (!fp)
+        die("fopen");
+    int i;
+    for (i = 0; i < 10000; i++)
+        fprintf(fp, "line %d\n", i);
+    fclose(fp);
+    editorOpen(path);
+    editorLoadAll();
+    E.screenrows = 20;
+    E.screencols = 80;
+    int separate = benchCheckPages(20, 0);
+    int queued = benchCheckPages(20, 1);
+    if (separate != queued)
+    {
+        printf("mismatch: 20 PAGE_DOWNs reach row %d separately, %d in one frame\n",
+               separate, queued);
+        fail = 1;
+    }
+    benchReset();
+    unlink(path);
+    printf(fail ? "check failed\n" : "check ok\n");
+    return fail;
+}
 
-        editorDelChar();
-        break;
+int benchMain(int argc, char *argv[])
+{
+    static const int defsizes[] = {10, 100, 1024, 4096};
+    static const char *mixname[] = {"short", "long", "mixed"};
+    int nsizes = argc > 0 ? argc : 4;
+    benchInit();
+    int threads = E.loadthreads;
+    const char *dir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    char path[PATH_MAX];
+    snprintf(path, sizeof(path), "%s/kilo-bench-%d.txt", dir, (int)getpid());
 
-    case PAGE_UP:
-    case PAGE_DOWN:
-    { //回到窗口的顶部
-        if (c == PAGE_UP)
-        {
-            E.cy = E.rowoff;
-        }
-        //回到窗口的底部
-        else if (c == PAGE_DOWN)
+    printf("%8s %6s %10s %12s %12s %12s\n", "size", "mix", "rows",
+           "read MB/s", "1 thr MB/s", "par MB/s");
+    int i, mix;
+    for (i = 0; i < nsizes; i++)
+    {
+        int mb = argc > 0 ? atoi(argv[i]) : defsizes[i];
+        for (mix = 0; mix < 3; mix++)
         {
-            E.cy = E.rowoff + E.screenrows - 1;
-            if (E.cy > E.numrows)
-                E.cy = E.numrows;
+            double rd, one, par;
+            int rows;
+            benchGenerate(path, (size_t)mb << 20, mix);
+            benchLoad(path, 1, &rd, &one, &rows);
+            benchLoad(path, threads, &rd, &par, &rows);
+            printf("%6dMB %6s %10d %12.0f %12.0f %12.0f\n", mb, mixname[mix],
+                   rows, rd, one, par);
+            fflush(stdout);
         }
-
-        int times = E.screenrows;
-        while (times--)
-            editorMoveCursor(c == PAGE_UP ? ARROW_UP : ARROW_DOWN);
-    }
-    break;
-        //方向键
-    case ARROW_UP:
-    case ARROW_DOWN:
-    case ARROW_LEFT:
-    case ARROW_RIGHT:
-        editorMoveCursor(c);
-        break;
-
-    case CTRL_KEY('l'):
-    case '\x1b':
-        break;
-        //若按键不特殊，就插入
-
-    default:
-        editorInsertChar(c);
-        break;
     }
-    //若输入非ctrl-q，重置退出警告次数
-    quit_times = KILO_QUIT_TIMES;
+    unlink(path);
+    printf("(%d threads)\n", threads);
+    return 0;
 }
+#endif
 
 /*** init ***/
 
+//取得窗口大小并重新分配上一帧的屏幕内容，下一次刷新时整屏重绘。启动和收到SIGWINCH后调用
+int editorResize()
+{
+    int rows, cols, i;
+    E.input.resized = 0;
+    if (getWindowSize(&rows, &cols) == -1)
+        return -1;
+    for (i = 0; i < E.frame.lines; i++)
+        free(E.frame.line[i].b);
+    free(E.frame.line);
+    E.screenrows = rows - 2;
+    E.screencols = cols;
+    //上一帧的屏幕内容，包括状态栏和信息栏
+    E.frame.lines = E.screenrows + 2;
+    E.frame.line = calloc(E.frame.lines, sizeof(screenLine));
+    editorFrameInvalidate();
+    return 0;
+}
+
 void initEditor()
 {
     E.cx = 0;
@@ -1353,36 +7209,107 @@ void initEditor()
     E.rowoff = 0;
     E.coloff = 0;
     E.numrows = 0;
-    E.row = NULL;
+    E.rowroot = NULL;
+    E.rowleaf = NULL;
+    E.rowleafstart = 0;
+    E.orig = NULL;
+    E.origlen = 0;
+    E.origscan = 0;
+    E.origmapped = 0;
+    pthread_mutex_init(&E.load.lock, NULL);
+    pthread_cond_init(&E.load.cond, NULL);
+    pthread_mutex_init(&E.journal.lock, NULL);
+    pthread_cond_init(&E.journal.cond, NULL);
+    pthread_cond_init(&E.journal.done, NULL);
+    E.journal.fd = -1;
+    E.load.active = 0;
+    E.load.queue = NULL;
+    E.load.qlen = E.load.qcap = 0;
+    E.loadthreads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (E.loadthreads < 1)
+        E.loadthreads = 1;
+    if (E.loadthreads > KILO_LOAD_MAX_THREADS)
+        E.loadthreads = KILO_LOAD_MAX_THREADS;
+    editorSearchInit(E.loadthreads);
     E.dirty = 0;
     E.filename = NULL;
     E.statusmsg[0] = '\0';
     E.statusmsg_time = 0;
+    //MINIVIM_UNDOMEM=N把撤销记录的内存上限设为N MB
+    const char *undomem = getenv("MINIVIM_UNDOMEM");
+    E.undo.limit = undomem && atoll(undomem) > 0 ? (size_t)atoll(undomem) << 20
+                                                 : KILO_UNDO_MEM_LIMIT;
 
-    if (getWindowSize(&E.screenrows, &E.screencols) == -1)
+    editorInputInit();
+    if (editorResize() == -1)
         die("getWindowSize");
-    E.screenrows -= 2;
+    E.debug = getenv("MINIVIM_DEBUG") != NULL;
+    //MINIVIM_SAVE=atomic时每次保存都完整写临时文件再改名
+    E.savemode = getenv("MINIVIM_SAVE") && strcmp(getenv("MINIVIM_SAVE"), "atomic") == 0
+                     ? SAVE_ATOMIC
+                     : SAVE_DELTA;
+    //渲染缓存至少能容纳两屏
+    editorRenderInit(E.screenrows * 2 > KILO_RENDER_CACHE ? E.screenrows * 2 : KILO_RENDER_CACHE);
+}
+
+/*处理一个按键（没有输入时等待），再处理所有已经到达的按键。距上一帧不足KILO_FRAME_MS毫秒时
+等到这一帧的时间再返回，限制帧率。每个按键之后都调整窗口位置：翻页按窗口位置计算目标行，
+连续的翻页要从上一次翻页后的窗口算起*/
+void editorProcessInput()
+{
+    editorProcessKeypress();
+    editorScroll();
+    E.frame.queued++;
+    while (1)
+    {
+        long left = KILO_FRAME_MS - editorElapsed(&E.frame.last);
+        if (!editorInputPending(left > 0 ? left : 0))
+            break;
+        editorProcessKeypress();
+        editorScroll();
+        E.frame.queued++;
+    }
+}
+
+/*主循环的一步：刷新屏幕，处理这一帧到达的所有按键后才刷新下一帧，
+连续的翻页、按住方向键或粘贴时不必每个按键重绘一次*/
+void editorStep()
+{
+    editorRefreshScreen();
+    editorProcessInput();
 }
 
 int main(int argc, char *argv[])
 {
+#ifdef KILO_BENCH
+    if (argc >= 2 && strcmp(argv[1], "--bench") == 0)
+        return benchMain(argc - 2, argv + 2);
+    if (argc >= 2 && strcmp(argv[1], "--bench-search") == 0)
+        return benchSearchMain(argc - 2, argv + 2);
+    if (argc >= 2 && strcmp(argv[1], "--bench-save") == 0)
+        return benchSaveMain(argc - 2, argv + 2);
+    if (argc >= 2 && strcmp(argv[1], "--bench-alloc") == 0)
+        return benchAllocMain(argc - 2, argv + 2);
+    if (argc >= 2 && strcmp(argv[1], "--bench-mem") == 0)
+        return benchMemMain(argc - 2, argv + 2);
+    if (argc >= 2 && strcmp(argv[1], "--bench-rx") == 0)
+        return benchRxMain(argc - 2, argv + 2);
+    if (argc >= 2 && strcmp(argv[1], "--check") == 0)
+        return benchCheckMain();
+#endif
     enableRawMode();
     initEditor();
 
-    InitStack(&S);
+    editorSetStatusMessage( //change!
+        "HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find | Ctro-R = replace");
+
     if (argc >= 2)
     {
         editorOpen(argv[1]);
     }
 
-    editorSetStatusMessage( //change!
-        "HELP: Ctrl-S = save | Ctrl-Q = quit | Ctrl-F = find | Ctro-R = replace");
-
     while (1)
-    {
-        editorRefreshScreen();
-        editorProcessKeypress();
-    }
+        editorStep();
 
     return 0;
 }